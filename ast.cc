@@ -76,6 +76,8 @@ struct BinAST : public AST
     int getOp() const { return op; }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> lhs, rhs;
     int op;
 };
@@ -87,6 +89,8 @@ struct BlockAST : public AST
     const std::vector<std::unique_ptr<AST>>& getAsts() const { return asts; }
 
 private:
+    friend struct Optimizer;
+
     std::vector<std::unique_ptr<AST>> asts;
 };
 
@@ -99,6 +103,8 @@ struct IfAST : public AST
     const AST* getAlt() const { return alt.get(); }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> cond, body, alt;
 };
 
@@ -110,6 +116,8 @@ struct WhileAST : public AST
     const AST& getBody() const { return *body; }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> cond, body;
 };
 
@@ -121,6 +129,8 @@ struct FuncAST : public AST
     const AST& getBody() const { return *body; }
 
 private:
+    friend struct Optimizer;
+
     std::string name;
     std::unique_ptr<AST> body;
 };
@@ -133,6 +143,8 @@ struct CallAST : public AST
     const std::vector<std::unique_ptr<AST>>& getArgs() const { return args; }
 
 private:
+    friend struct Optimizer;
+
     std::string funcName;
     std::vector<std::unique_ptr<AST>> args;
 };
@@ -144,6 +156,8 @@ struct ReturnAST : public AST
     const AST* getValue() const { return value.get(); }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> value;
 };
 
@@ -164,6 +178,8 @@ struct UnaryAST : public AST
     int getOp() const { return op; }
 
 private:
+    friend struct Optimizer;
+
     int op;
     std::unique_ptr<AST> rhs;
 };
@@ -175,6 +191,8 @@ struct ParenAST : public AST
     const AST& getInner() const { return *inner; }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> inner;
 };
 
@@ -186,6 +204,8 @@ struct CastAST : public AST
     const AST& getValue() const { return *value; }
 
 private:
+    friend struct Optimizer;
+
     std::unique_ptr<AST> value;
     std::unique_ptr<Typetag> targetType;
 };
@@ -31,18 +31,44 @@ func putc(c : char) : void {
     asm "sw $1 0($3)";
 }
 
+// Writes len chars starting at s in one block transfer
+func write(s : *char, len : int) : void {
+    asm "lis $4";
+    asm ".word 0xffff0010";
+    asm "sw $1 0($4)";
+    asm "sw $2 4($4)";
+}
+
+// Reads up to len chars (stopping after a newline) into buf in one block
+// transfer and returns how many were read
+func read(buf : *char, len : int) : int {
+    var count : int = 0;
+
+    asm "lis $5";
+    asm ".word 0xffff0010";
+    asm "sw $1 0($5)";
+    asm "sw $2 8($5)";
+    asm "lw $3 8($5)";
+
+    return count;
+}
+
+// Saves the machine when run with --snapshot so later runs can --restore from here
+func checkpoint() : void {
+    asm "lis $4";
+    asm ".word 0xffff0020";
+    asm "sw $0 0($4)";
+}
+
 func puts(s : *char) : void {
     asm "lis $3";
     asm ".word 0xffff000c";
 
-    asm "lis $5";
-    asm ".word 4";
-
     asm "putsLoop:";
-    asm "lw $4 0($1)";
+    asm "lb $4 0($1)";
     asm "beq $4 $0 putsEnd";
     asm "sw $4 0($3)";
-    asm "add $1 $1 $5";
+    asm "addi $1 $1 1";
     asm "lis $4";
     asm ".word putsLoop";
     asm "jr $4";
@@ -68,13 +94,13 @@ func putn(n : int) : void {
 
     while(n > 0) {
         *buf = '0' + cast(char)(n % 10);
-        buf = buf + 4;
+        buf = buf + 1;
         n = n / 10;
     }
 
     while(buf != bufStart) {
-        *cast(*char) 0xffff000c = *(buf - 4);
-        buf = buf - 4;
+        *cast(*char) 0xffff000c = *(buf - 1);
+        buf = buf - 1;
     }
 
     putc(cast(char) 10);
@@ -86,8 +112,8 @@ func strcmp(a : *char, b : *char) : int {
             return cast(int) (*a - *b);
         }
 
-        a = a + 4;
-        b = b + 4;
+        a = a + 1;
+        b = b + 1;
     }
 
     return cast(int) (*a - *b);
@@ -96,8 +122,8 @@ func strcmp(a : *char, b : *char) : int {
 func strcpy(dest : *char, src : *char) : void {
     while(*src != cast(char) 0) {
         *dest = *src;
-        dest = dest + 4;
-        src = src + 4;
+        dest = dest + 1;
+        src = src + 1;
     }
 
     *dest = cast(char) 0;
@@ -107,13 +133,13 @@ func strcat(dest : *char, src : *char) : void {
     var end : *char = dest;
 
     while(*end != 0) {
-        end = end + 4;
+        end = end + 1;
     }
 
     while(*src != 0) {
         *end = *src;
-        end = end + 4;
-        src = src + 4;
+        end = end + 1;
+        src = src + 1;
     }
 
     *end = cast(char) 0;
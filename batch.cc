@@ -0,0 +1,166 @@
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+
+// Runs a fixed set of independent tasks on a fixed number of threads. Each
+// worker owns a deque of task indices: it pops from the back of its own and,
+// once that runs dry, steals from the front of the others. Tasks never add
+// more tasks, so a worker that finds every deque empty is done.
+struct WorkStealingPool
+{
+    explicit WorkStealingPool(unsigned threadCount) : threadCount{threadCount ? threadCount : 1} {}
+
+    unsigned getThreadCount() const { return threadCount; }
+
+    // Blocks until every task has run
+    void run(const std::vector<std::function<void()>>& tasks)
+    {
+        std::vector<Queue> queues(threadCount);
+
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            queues[i % threadCount].indices.push_back(i);
+        }
+
+        auto worker = [&](unsigned self) {
+            size_t index;
+
+            while(take(queues, self, index)) {
+                tasks[index]();
+            }
+        };
+
+        std::vector<std::thread> threads;
+
+        for(unsigned i = 1; i < threadCount; ++i) {
+            threads.emplace_back(worker, i);
+        }
+
+        // The calling thread pulls its weight too
+        worker(0);
+
+        for(auto& t : threads) {
+            t.join();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> indices;
+    };
+
+    unsigned threadCount;
+
+    static bool take(std::vector<Queue>& queues, unsigned self, size_t& index)
+    {
+        {
+            auto& own = queues[self];
+            std::lock_guard<std::mutex> lock{own.mutex};
+
+            if(!own.indices.empty()) {
+                index = own.indices.back();
+                own.indices.pop_back();
+                return true;
+            }
+        }
+
+        for(size_t i = 1; i < queues.size(); ++i) {
+            auto& victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock{victim.mutex};
+
+            if(!victim.indices.empty()) {
+                index = victim.indices.front();
+                victim.indices.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+// One run of a compiled image
+struct BatchJob
+{
+    const std::vector<Instruction>* code;
+    bool mips;                  // The image is MIPS32 (see decoder.cc)
+
+    std::string inputPath;      // Empty for no input
+    std::string outputPath;
+};
+
+struct BatchResult
+{
+    bool ok = false;
+    std::string error;
+
+    uint64_t instructions = 0;  // Only counted by the interpreter when asked for
+    double seconds = 0;         // Wall time, including opening the files
+};
+
+// Runs every job in its own VM across the pool. If count is set, the
+// interpreter counts the instructions each run retires (the JIT can't).
+std::vector<BatchResult> runBatch(const std::vector<BatchJob>& jobs, WorkStealingPool& pool, size_t memSize, bool jit, bool count = false)
+{
+    std::vector<BatchResult> results(jobs.size());
+    std::vector<std::function<void()>> tasks;
+
+    for(size_t i = 0; i < jobs.size(); ++i) {
+        tasks.emplace_back([&jobs, &results, memSize, jit, count, i]() {
+            auto& job = jobs[i];
+            auto& result = results[i];
+
+            auto start = std::chrono::steady_clock::now();
+
+            FILE* in = nullptr;
+            FILE* out = nullptr;
+
+            try {
+                if(!job.inputPath.empty()) {
+                    in = fopen(job.inputPath.c_str(), "rb");
+
+                    if(!in) {
+                        throw std::runtime_error{"Failed to open input file " + job.inputPath};
+                    }
+                }
+
+                out = fopen(job.outputPath.c_str(), "wb");
+
+                if(!out) {
+                    throw std::runtime_error{"Failed to open output file " + job.outputPath};
+                }
+
+                {
+                    VM vm{&(*job.code)[0], job.code->size() * sizeof(Instruction), in, out, memSize, job.mips};
+
+                    if(jit) {
+                        vm.runJit();
+                    } else if(count) {
+                        vm.run(nullptr, &result.instructions);
+                    } else {
+                        vm.run();
+                    }
+                }
+
+                result.ok = true;
+            } catch(const std::exception& e) {
+                result.error = e.what();
+            }
+
+            if(in) fclose(in);
+            if(out) fclose(out);
+
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        });
+    }
+
+    pool.run(tasks);
+
+    return results;
+}
@@ -1,9 +1,51 @@
 #include <sstream>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+
+// Registers from here up are virtual. The compiler hands them out freely and
+// the register allocator (see regalloc.cc) maps them onto real ones before
+// the code gets encoded.
+const int FIRST_VREG = 32;
+
+// Branches to labels too far away for a 16-bit offset become long jumps
+// through this register, as do loads and stores of labels too far from 0 to
+// reach from $0 (it's the link register, which compiled code only uses right
+// around calls and returns)
+const int LONG_JUMP_REG = 31;
 
 struct Codegen
 {
+    // An entry in the instruction stream. Code stays in this form until
+    // getPatchedCode so that passes can rewrite it.
+    struct Op
+    {
+        enum Kind
+        {
+            INSTR,      // An instruction of the given type
+            WORD,       // A data word: imm, or the address of label if there is one
+            LABEL,      // Names the word after it; takes up no space
+            CALL,       // Calls function label with imm arguments, the first of which are in registers (lowered by RegAlloc)
+            TAIL_CALL,  // Returns by jumping to function label with imm arguments, all in registers (lowered by RegAlloc)
+            RET,        // Returns from the function, with a value if imm is set (lowered by RegAlloc)
+            ARG,        // Loads stack argument imm into d (lowered by RegAlloc)
+            FRAME       // Puts the address of byte imm of the function's local arrays into d (lowered by RegAlloc)
+        };
+
+        Kind kind;
+
+        // The ops with an immediate (see isImmAlu) write d, which ends up in the t field
+        Instruction::Type type;
+        int s, t, d;
+
+        // Immediate for loads, stores and the immediate ALU ops, offset for branches without a label
+        int32_t imm;
+
+        // The label defined (LABEL), referenced (WORD, branches) or called (CALL).
+        // Loads and stores with one reach the address of the label plus imm from $0.
+        std::string label;
+    };
+
     // Assembles str into instructions
     void parse(Pos pos, const std::string& str)
     {
@@ -24,21 +66,21 @@ struct Codegen
                     throw PosError{pos, "Failed to convert to value: " + temp};
                 }
 
-                if(value < -2147483647L && value > 4294967295) {
+                if(value < -2147483648LL || value > 4294967295LL) {
                     throw PosError{pos, "Word value out of range: " + std::to_string(value)};
                 }
 
                 word(static_cast<int32_t>(value));
             } else if(isalpha(temp[0])) {
-                patches.emplace_back(Patch::WORD, code.size(), temp);
-                word(0);
+                word(temp);
             }
         } else if(temp[temp.size() - 1] == ':') {
             labelHere(temp.substr(0, temp.size() - 1));
         } else if(temp == "lis") {
             s >> temp;
             lis(parseReg(pos, temp));
-        } else if(temp == "add" || temp == "sub" || temp == "slt") {
+        } else if(temp == "add" || temp == "sub" || temp == "slt" || temp == "and" || temp == "or" || temp == "xor" ||
+                  temp == "sllv" || temp == "srav") {
             auto instr = temp;
 
             int regs[3];
@@ -54,6 +96,48 @@ struct Codegen
             if(instr == "add") add(regs[0], regs[1], regs[2]);
             else if(instr == "sub") sub(regs[0], regs[1], regs[2]);
             else if(instr == "slt") slt(regs[0], regs[1], regs[2]);
+            else if(instr == "and") and_(regs[0], regs[1], regs[2]);
+            else if(instr == "or") or_(regs[0], regs[1], regs[2]);
+            else if(instr == "xor") xor_(regs[0], regs[1], regs[2]);
+            else if(instr == "sllv") sllv(regs[0], regs[1], regs[2]);
+            else if(instr == "srav") srav(regs[0], regs[1], regs[2]);
+        } else if(temp == "addi" || temp == "slti" || temp == "ori" || temp == "andi" || temp == "sll" || temp == "sra" || temp == "srl") {
+            auto instr = temp;
+
+            int regs[2];
+
+            for(int i = 0; i < 2; ++i) {
+                if(!(s >> temp)) {
+                    throw PosError{pos, "Expected register"};
+                }
+
+                regs[i] = parseReg(pos, temp);
+            }
+
+            if(!(s >> temp)) {
+                throw PosError{pos, "Expected immediate"};
+            }
+
+            auto value = parseImm(pos, temp, instr != "addi" && instr != "slti");
+
+            if(instr == "addi") addi(regs[0], regs[1], value);
+            else if(instr == "slti") slti(regs[0], regs[1], value);
+            else if(instr == "ori") ori(regs[0], regs[1], value);
+            else if(instr == "andi") andi(regs[0], regs[1], value);
+            else if(value > 31) throw PosError{pos, "Shift amount out of range: " + temp};
+            else if(instr == "sll") sll(regs[0], regs[1], value);
+            else if(instr == "sra") sra(regs[0], regs[1], value);
+            else if(instr == "srl") srl(regs[0], regs[1], value);
+        } else if(temp == "lui") {
+            s >> temp;
+
+            int d = parseReg(pos, temp);
+
+            if(!(s >> temp)) {
+                throw PosError{pos, "Expected immediate"};
+            }
+
+            lui(d, parseImm(pos, temp, true));
         } else if(temp == "mult" || temp == "div") {
             auto instr = temp;
             
@@ -69,12 +153,19 @@ struct Codegen
 
             if(instr == "mult") mult(regs[0], regs[1]);
             else if(instr == "div") div(regs[0], regs[1]);
-        } else if(temp == "beq" || temp == "bne") {
-            auto instr = temp;
+        } else if(temp == "beq" || temp == "bne" || temp == "bltz" || temp == "bgez" || temp == "blez" || temp == "bgtz") {
+            auto type = temp == "beq" ? Instruction::BEQ :
+                        temp == "bne" ? Instruction::BNE :
+                        temp == "bltz" ? Instruction::BLTZ :
+                        temp == "bgez" ? Instruction::BGEZ :
+                        temp == "blez" ? Instruction::BLEZ : Instruction::BGTZ;
 
-            int regs[2];
+            // The ones which compare against zero only take one register
+            int regCount = type == Instruction::BEQ || type == Instruction::BNE ? 2 : 1;
 
-            for(int i = 0; i < 2; ++i) {
+            int regs[2] = {0, 0};
+
+            for(int i = 0; i < regCount; ++i) {
                 if(!(s >> temp)) {
                     throw PosError{pos, "Expected register"};
                 }
@@ -84,23 +175,18 @@ struct Codegen
             
             s >> temp;
 
-            int16_t imm = 0;
-        
             if(isalpha(temp[0])) {
-                patches.emplace_back(Patch::BRANCH, code.size(), temp);
+                instr(type, regs[0], regs[1], 0, 0, temp);
             } else {
                 auto off = std::stoi(temp, nullptr, 0);
 
-                if(off < -32768 && off > 32767) {
+                if(off < -32768 || off > 32767) {
                     throw PosError{pos, "Branch offset out of range"};
                 }
 
-                imm = static_cast<int16_t>(off);
+                instr(type, regs[0], regs[1], 0, static_cast<int16_t>(off));
             }
-
-            if(instr == "beq") beq(regs[0], regs[1], imm);
-            else if(instr == "bne") bne(regs[0], regs[1], imm);
-        } else if(temp == "lw" || temp == "sw") {
+        } else if(temp == "lw" || temp == "sw" || temp == "lb" || temp == "sb") {
             auto instr = temp;
 
             s >> temp;
@@ -111,7 +197,7 @@ struct Codegen
 
             s >> off;
 
-            if(off < -32768 && off > 32767) {
+            if(off < -32768 || off > 32767) {
                 throw PosError{pos, "Memory offset out of range"};
             }
 
@@ -137,6 +223,8 @@ struct Codegen
 
             if(instr == "lw") lw(t, imm, sr);
             else if(instr == "sw") sw(t, imm, sr);
+            else if(instr == "lb") lb(t, imm, sr);
+            else if(instr == "sb") sb(t, imm, sr);
         } else if(temp == "jr" || temp == "jalr" || temp == "mfhi" || temp == "mflo") {
             auto instr = temp;
 
@@ -151,36 +239,257 @@ struct Codegen
         }
     }
 
-    // Get the position in memory of the next instruction
+    // Gives every branch in ops with a plain offset a label (named after
+    // prefix) so that code can be inserted and removed around it
+    static void labelBranches(std::vector<Op>& ops, const std::string& prefix)
+    {
+        std::vector<size_t> opOfWord;
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            if(ops[i].kind != Op::LABEL) {
+                opOfWord.push_back(i);
+            }
+        }
+
+        opOfWord.push_back(ops.size());
+
+        std::vector<std::string> labelAt(ops.size() + 1);
+        int count = 0;
+
+        size_t word = 0;
+
+        for(auto& op : ops) {
+            if(op.kind == Op::LABEL) {
+                continue;
+            }
+
+            if(op.kind == Op::INSTR && isBranch(op.type) && op.label.empty()) {
+                auto target = static_cast<int64_t>(word) + 1 + op.imm;
+
+                if(target < 0 || target >= static_cast<int64_t>(opOfWord.size())) {
+                    throw std::runtime_error{"Branch in " + prefix + " goes outside the code"};
+                }
+
+                auto& name = labelAt[opOfWord[target]];
+
+                if(name.empty()) {
+                    name = prefix + "XXXXbranch" + std::to_string(count++);
+                }
+
+                op.label = name;
+            }
+
+            ++word;
+        }
+
+        std::vector<Op> labelled;
+
+        for(size_t i = 0; i <= ops.size(); ++i) {
+            if(!labelAt[i].empty()) {
+                labelled.push_back(Op{Op::LABEL, Instruction::LIS, 0, 0, 0, 0, labelAt[i]});
+            }
+
+            if(i < ops.size()) {
+                labelled.push_back(std::move(ops[i]));
+            }
+        }
+
+        ops = std::move(labelled);
+    }
+
+    // Where everything ends up once branches (and loads and stores of
+    // labels) have been relaxed. The image is the code followed by the
+    // rodata; the bss comes after that, outside the image.
+    struct Layout
+    {
+        // Whether each op takes its long form
+        std::vector<bool> isLong;
+
+        // Maps label names to the index of the word they label
+        std::unordered_map<std::string, int> labels;
+    };
+
+    static bool isLoadStore(Instruction::Type type)
+    {
+        return type == Instruction::LW || type == Instruction::SW || type == Instruction::LB || type == Instruction::SB;
+    }
+
+    // Every branch to a label starts out as a single instruction. Any which
+    // can't reach their label take the long form (see getPatchedCode), which
+    // pushes everything after them along, so this goes around until nothing
+    // else has to grow. Branches with plain offsets are left alone, so they
+    // shouldn't span one that might grow (the peephole pass labels them all).
+    Layout getLayout() const
+    {
+        Layout layout;
+
+        layout.isLong.assign(code.size(), false);
+
+        std::vector<int> index(code.size());
+
+        while(true) {
+            layout.labels.clear();
+
+            int words = 0;
+
+            for(size_t i = 0; i < code.size(); ++i) {
+                index[i] = words;
+
+                if(code[i].kind == Op::LABEL) {
+                    layout.labels[code[i].label] = words;
+                } else {
+                    words += getSize(code[i], layout.isLong[i]);
+                }
+            }
+
+            for(auto& op : rodataOps) {
+                if(op.kind == Op::LABEL) {
+                    layout.labels[op.label] = words;
+                } else {
+                    ++words;
+                }
+            }
+
+            for(auto& b : bssWords) {
+                layout.labels[b.first] = words;
+                words += b.second;
+            }
+
+            bool grew = false;
+
+            for(size_t i = 0; i < code.size(); ++i) {
+                auto& op = code[i];
+
+                if(op.kind != Op::INSTR || op.label.empty() || layout.isLong[i]) {
+                    continue;
+                }
+
+                auto found = layout.labels.find(op.label);
+
+                // getPatchedCode reports this
+                if(found == layout.labels.end()) {
+                    continue;
+                }
+
+                auto offset = isLoadStore(op.type) ? found->second * static_cast<int>(sizeof(Instruction)) + op.imm :
+                                                     found->second - index[i] - 1;
+
+                if(offset < -32768 || offset > 32767) {
+                    layout.isLong[i] = true;
+                    grew = true;
+                }
+            }
+
+            if(!grew) {
+                return layout;
+            }
+        }
+    }
+
+    // Maps label names to the index of the word they label
+    std::unordered_map<std::string, int> getLabels() const
+    {
+        return getLayout().labels;
+    }
+
+    // Get the position in memory of the next instruction (assuming no
+    // branches before it need relaxing)
     int32_t getPos() const
     {
-        return code.size() * sizeof(Instruction);
+        return static_cast<int32_t>(wordCount * sizeof(Instruction));
     }
 
-    void labelHere(std::string name)
+    const std::vector<Op>& getCode() const
     {
-        if(labels.find(name) != labels.end()) {
-            throw std::runtime_error{"Defined multiple labels with the name " + name};
+        return code;
+    }
+
+    // Replaces the whole instruction stream (for passes which rewrite it)
+    void setCode(std::vector<Op> newCode)
+    {
+        code = std::move(newCode);
+
+        wordCount = 0;
+        labelNames.clear();
+
+        for(auto& op : code) {
+            if(op.kind == Op::LABEL) {
+                addLabelName(op.label);
+            } else {
+                ++wordCount;
+            }
+        }
+
+        for(auto& op : rodataOps) {
+            if(op.kind == Op::LABEL) {
+                addLabelName(op.label);
+            }
+        }
+
+        for(auto& b : bssWords) {
+            addLabelName(b.first);
         }
+    }
+
+    // Puts words in the read-only data after the code, labelled name
+    void rodata(const std::string& name, const std::vector<int32_t>& words)
+    {
+        addLabelName(name);
+
+        rodataOps.push_back(Op{Op::LABEL, Instruction::LIS, 0, 0, 0, 0, name});
 
-        labels[std::move(name)] = static_cast<int32_t>(code.size());
+        for(auto w : words) {
+            rodataOps.push_back(Op{Op::WORD, Instruction::LIS, 0, 0, 0, w, {}});
+        }
+    }
+
+    // Reserves count words past the end of the image, labelled name. Memory
+    // starts out zeroed, so they cost nothing to load.
+    void bss(const std::string& name, int32_t count)
+    {
+        addLabelName(name);
+
+        bssWords.emplace_back(name, count);
+    }
+
+    // Adds the code from other to the end of this
+    void append(const Codegen& other)
+    {
+        for(auto& op : other.code) {
+            push(op);
+        }
+    }
+
+    void push(Op op)
+    {
+        if(op.kind == Op::LABEL) {
+            addLabelName(op.label);
+        } else {
+            ++wordCount;
+        }
+
+        code.push_back(std::move(op));
+    }
+
+    void labelHere(std::string name)
+    {
+        push(Op{Op::LABEL, Instruction::LIS, 0, 0, 0, 0, std::move(name)});
     }
     
     void lis(int reg)
     {
-        code.emplace_back(rInst(Instruction::LIS, 0, 0, reg));
+        instr(Instruction::LIS, 0, 0, reg);
     }
 
     void word(int32_t value)
     {
-        code.emplace_back(wInst(value));
+        push(Op{Op::WORD, Instruction::LIS, 0, 0, 0, value, {}});
     }
     
     void word(const std::string& labelName)
     {
         // This will be patched
-        patches.emplace_back(Patch::WORD, code.size(), labelName);
-        code.emplace_back(wInst(0));
+        push(Op{Op::WORD, Instruction::LIS, 0, 0, 0, 0, labelName});
     }
 
     void lis(int reg, int32_t value)
@@ -195,142 +504,454 @@ struct Codegen
         word(labelName);
     }
 
+    // Loads value into reg in one instruction, taking a single word when
+    // an immediate can hold it
+    void li(int reg, int32_t value)
+    {
+        if(value >= -32768 && value <= 32767) {
+            addi(reg, 0, value);
+        } else if(value >= 0 && value <= 0xffff) {
+            ori(reg, 0, value);
+        } else if((value & 0xffff) == 0) {
+            lui(reg, static_cast<uint32_t>(value) >> 16);
+        } else {
+            lis(reg, value);
+        }
+    }
+
     void add(int d, int s, int t)
     {
-        code.emplace_back(rInst(Instruction::ADD, s, t, d));
+        instr(Instruction::ADD, s, t, d);
     }
 
     void sub(int d, int s, int t)
     {
-        code.emplace_back(rInst(Instruction::SUB, s, t, d));
+        instr(Instruction::SUB, s, t, d);
+    }
+
+    void addi(int d, int s, int32_t imm)
+    {
+        instr(Instruction::ADDI, s, 0, d, imm);
+    }
+
+    void slti(int d, int s, int32_t imm)
+    {
+        instr(Instruction::SLTI, s, 0, d, imm);
+    }
+
+    // imm is the top half
+    void lui(int d, int32_t imm)
+    {
+        instr(Instruction::LUI, 0, 0, d, imm);
+    }
+
+    // imm is zero-extended
+    void ori(int d, int s, int32_t imm)
+    {
+        instr(Instruction::ORI, s, 0, d, imm);
+    }
+
+    void andi(int d, int s, int32_t imm)
+    {
+        instr(Instruction::ANDI, s, 0, d, imm);
+    }
+
+    // Shifts by a constant amount
+    void sll(int d, int s, int amount)
+    {
+        instr(Instruction::SLL, s, 0, d, amount);
+    }
+
+    void sra(int d, int s, int amount)
+    {
+        instr(Instruction::SRA, s, 0, d, amount);
+    }
+
+    void srl(int d, int s, int amount)
+    {
+        instr(Instruction::SRL, s, 0, d, amount);
+    }
+
+    // and, or and xor are taken
+    void and_(int d, int s, int t)
+    {
+        instr(Instruction::AND, s, t, d);
+    }
+
+    void or_(int d, int s, int t)
+    {
+        instr(Instruction::OR, s, t, d);
+    }
+
+    void xor_(int d, int s, int t)
+    {
+        instr(Instruction::XOR, s, t, d);
+    }
+
+    // Shifts s by the amount in t
+    void sllv(int d, int s, int t)
+    {
+        instr(Instruction::SLLV, s, t, d);
+    }
+
+    void srav(int d, int s, int t)
+    {
+        instr(Instruction::SRAV, s, t, d);
     }
 
     void mult(int s, int t)
     {
-        code.emplace_back(rInst(Instruction::MULT, s, t, 0));
+        instr(Instruction::MULT, s, t, 0);
     }
 
     void div(int s, int t)
     {
-        code.emplace_back(rInst(Instruction::DIV, s, t, 0));
+        instr(Instruction::DIV, s, t, 0);
     }
 
     void slt(int d, int s, int t)
     {
-        code.emplace_back(rInst(Instruction::SLT, s, t, d));
+        instr(Instruction::SLT, s, t, d);
     }
 
     void mfhi(int d)
     {
-        code.emplace_back(rInst(Instruction::MFHI, 0, 0, d));
+        instr(Instruction::MFHI, 0, 0, d);
     }
 
     void mflo(int d)
     {
-        code.emplace_back(rInst(Instruction::MFLO, 0, 0, d));
+        instr(Instruction::MFLO, 0, 0, d);
     }
 
     void lw(int t, int16_t imm, int s)
     {
-        code.emplace_back(iInst(Instruction::LW, s, t, imm));
+        instr(Instruction::LW, s, t, 0, imm);
     }
 
     void sw(int t, int16_t imm, int s)
     {
-        code.emplace_back(iInst(Instruction::SW, s, t, imm));
+        instr(Instruction::SW, s, t, 0, imm);
+    }
+
+    void lb(int t, int16_t imm, int s)
+    {
+        instr(Instruction::LB, s, t, 0, imm);
+    }
+
+    void sb(int t, int16_t imm, int s)
+    {
+        instr(Instruction::SB, s, t, 0, imm);
+    }
+
+    // Loads the word at label into t
+    void lw(int t, const std::string& label)
+    {
+        instr(Instruction::LW, 0, t, 0, 0, label);
+    }
+
+    // Stores t into the word at label (t can't be LONG_JUMP_REG, which a
+    // far store goes through)
+    void sw(int t, const std::string& label)
+    {
+        instr(Instruction::SW, 0, t, 0, 0, label);
     }
 
     void beq(int s, int t, int16_t imm)
     {
-        code.emplace_back(iInst(Instruction::BEQ, s, t, imm));
+        instr(Instruction::BEQ, s, t, 0, imm);
     }
 
     void beq(int s, int t, const std::string& labelName)
     {
-        patches.emplace_back(Patch::BRANCH, code.size(), labelName);
-        code.emplace_back(iInst(Instruction::BEQ, s, t, 0));
+        instr(Instruction::BEQ, s, t, 0, 0, labelName);
     }
 
     void bne(int s, int t, int16_t imm)
     {
-        code.emplace_back(iInst(Instruction::BNE, s, t, imm));
+        instr(Instruction::BNE, s, t, 0, imm);
     }
 
     void bne(int s, int t, const std::string& labelName)
     {
-        patches.emplace_back(Patch::BRANCH, code.size(), labelName);
-        code.emplace_back(iInst(Instruction::BNE, s, t, 0));
+        instr(Instruction::BNE, s, t, 0, 0, labelName);
+    }
+
+    // Any kind of branch to a label (t is ignored by the ones which compare against zero)
+    void branch(Instruction::Type type, int s, int t, const std::string& labelName)
+    {
+        instr(type, s, t, 0, 0, labelName);
+    }
+
+    // Unconditional jump. This is a branch, so it only takes one word
+    // unless label turns out to be too far away.
+    void jump(const std::string& labelName)
+    {
+        beq(0, 0, labelName);
     }
 
     void jr(int s)
     {
-        code.emplace_back(rInst(Instruction::JR, s, 0, 0));
+        instr(Instruction::JR, s, 0, 0);
     }
 
     void jalr(int s)
     {
-        code.emplace_back(rInst(Instruction::JALR, s, 0, 0));
+        instr(Instruction::JALR, s, 0, 0);
+    }
+
+    // Calls funcName once its arguments are in place: the first ones in $1
+    // onwards and the rest on the stack (see RegAlloc)
+    void call(const std::string& funcName, int argCount)
+    {
+        push(Op{Op::CALL, Instruction::JALR, 0, 0, 0, argCount, funcName});
+    }
+
+    // Leaves the current function for funcName, which returns straight to
+    // our caller. Its arguments must all be in registers already.
+    void tailCall(const std::string& funcName, int argCount)
+    {
+        push(Op{Op::TAIL_CALL, Instruction::JR, 0, 0, 0, argCount, funcName});
+    }
+
+    // Returns from the current function (the value, if any, is already in RETVAL_REG)
+    void ret(bool value)
+    {
+        push(Op{Op::RET, Instruction::JR, 0, 0, 0, value ? 1 : 0, {}});
+    }
+
+    // Loads the current function's index'th stack argument (counting from
+    // the first one not passed in a register) into d
+    void arg(int d, int index)
+    {
+        push(Op{Op::ARG, Instruction::LW, 0, 0, d, index, {}});
+    }
+
+    // Puts the address offset bytes into the current function's local
+    // arrays into d
+    void frameAddr(int d, int32_t offset)
+    {
+        push(Op{Op::FRAME, Instruction::ADD, 0, 0, d, offset, {}});
     }
 
     std::vector<Instruction> getPatchedCode() const
     {
         // This just patches all the labels with the correct address
-        auto result = code;
+        auto layout = getLayout();
+        auto& labels = layout.labels;
 
-        for(auto& patch : patches) {
-            auto found = labels.find(patch.getLabelName());
+        auto find = [&](const std::string& name) {
+            auto found = labels.find(name);
 
             if(found == labels.end()) {
-                throw std::runtime_error{"Referenced undefined label " + patch.getLabelName()};
+                throw std::runtime_error{"Referenced undefined label " + name};
             }
 
-            switch(patch.getType()) {
-                case Patch::WORD: {
-                    result[patch.getPos()].word = found->second * sizeof(Instruction);
+            return found->second;
+        };
+
+        std::vector<Instruction> result;
+        result.reserve(wordCount);
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            auto& op = code[i];
+
+            switch(op.kind) {
+                case Op::LABEL: break;
+
+                case Op::WORD: {
+                    result.push_back(wInst(op.label.empty() ? op.imm : find(op.label) * static_cast<int32_t>(sizeof(Instruction))));
                 } break;
 
-                case Patch::BRANCH: {
-					int32_t isize = sizeof(Instruction);
-                    int32_t off = (found->second * isize - static_cast<int32_t>(patch.getPos()) * isize - isize) / isize;
-                    
-                    if(off < -32768 && off > 32767) {
-                        throw std::runtime_error{"Branch to label " + found->first + " is out of branch offset range (" + std::to_string(off) + ")"};
+                case Op::INSTR: {
+                    if(op.s >= FIRST_VREG || op.t >= FIRST_VREG || op.d >= FIRST_VREG) {
+                        throw std::runtime_error{"Virtual register left in the code"};
+                    }
+
+                    int32_t imm = op.imm;
+
+                    if(!op.label.empty() && isLoadStore(op.type)) {
+                        auto addr = find(op.label) * static_cast<int32_t>(sizeof(Instruction)) + op.imm;
+
+                        if(layout.isLong[i]) {
+                            result.push_back(rInst(Instruction::LIS, 0, 0, LONG_JUMP_REG));
+                            result.push_back(wInst(addr));
+                            result.push_back(iInst(op.type, LONG_JUMP_REG, op.t, 0));
+                        } else {
+                            result.push_back(iInst(op.type, 0, op.t, static_cast<int16_t>(addr)));
+                        }
+
+                        break;
+                    }
+
+                    if(!op.label.empty()) {
+                        auto target = find(op.label);
+
+                        if(layout.isLong[i]) {
+                            if(!isJump(op)) {
+                                // Skip the jump unless the branch would have been taken
+                                result.push_back(iInst(invertBranch(op.type), op.s, op.t, 3));
+                            }
+
+                            result.push_back(rInst(Instruction::LIS, 0, 0, LONG_JUMP_REG));
+                            result.push_back(wInst(target * static_cast<int32_t>(sizeof(Instruction))));
+                            result.push_back(rInst(Instruction::JR, LONG_JUMP_REG, 0, 0));
+                            break;
+                        }
+
+                        imm = target - static_cast<int32_t>(result.size()) - 1;
+
+                        if(imm < -32768 || imm > 32767) {
+                            throw std::runtime_error{"Branch to label " + op.label + " is out of branch offset range (" + std::to_string(imm) + ")"};
+                        }
+                    }
+
+                    switch(op.type) {
+                        case Instruction::LW: case Instruction::SW: case Instruction::LB: case Instruction::SB:
+                        case Instruction::BEQ: case Instruction::BNE:
+                        case Instruction::BLTZ: case Instruction::BGEZ: case Instruction::BLEZ: case Instruction::BGTZ: {
+                            result.push_back(iInst(op.type, op.s, op.t, static_cast<int16_t>(imm)));
+                        } break;
+
+                        default: {
+                            if(isImmAlu(op.type)) {
+                                result.push_back(iInst(op.type, op.s, op.d, static_cast<int16_t>(imm)));
+                            } else {
+                                result.push_back(rInst(op.type, op.s, op.t, op.d));
+                            }
+                        } break;
                     }
-                    
-					result[patch.getPos()].word |= static_cast<int16_t>(off) & 0xffff;
                 } break;
+
+                case Op::CALL: case Op::TAIL_CALL: case Op::RET: case Op::ARG: case Op::FRAME: {
+                    throw std::runtime_error{"Call, return or frame access left in the code without being lowered"};
+                }
+            }
+        }
+
+        for(auto& op : rodataOps) {
+            if(op.kind == Op::WORD) {
+                result.push_back(wInst(op.imm));
             }
         }
 
         return result;
     }
 
+    // The ops which write d from s and an immediate
+    static bool isImmAlu(Instruction::Type type)
+    {
+        switch(type) {
+            case Instruction::ADDI: case Instruction::SLTI: case Instruction::LUI: case Instruction::ORI:
+            case Instruction::ANDI: case Instruction::SLL: case Instruction::SRA: case Instruction::SRL: return true;
+            default: return false;
+        }
+    }
+
+    // The register an instruction writes (d, or t for loads), or -1 if it
+    // doesn't write one. JALR writes $31 but isn't counted here.
+    static int getWritten(const Op& op)
+    {
+        switch(op.type) {
+            case Instruction::LIS: case Instruction::ADD: case Instruction::SUB: case Instruction::SLT:
+            case Instruction::MFHI: case Instruction::MFLO:
+            case Instruction::AND: case Instruction::OR: case Instruction::XOR:
+            case Instruction::SLLV: case Instruction::SRAV: return op.d;
+
+            case Instruction::LW: case Instruction::LB: return op.t;
+
+            default: return isImmAlu(op.type) ? op.d : -1;
+        }
+    }
+
+    static bool readsS(Instruction::Type type)
+    {
+        return type != Instruction::LIS && type != Instruction::MFHI && type != Instruction::MFLO && type != Instruction::LUI;
+    }
+
+    static bool readsT(Instruction::Type type)
+    {
+        switch(type) {
+            case Instruction::ADD: case Instruction::SUB: case Instruction::SLT:
+            case Instruction::AND: case Instruction::OR: case Instruction::XOR:
+            case Instruction::SLLV: case Instruction::SRAV:
+            case Instruction::MULT: case Instruction::DIV:
+            case Instruction::SW: case Instruction::SB: case Instruction::BEQ: case Instruction::BNE: return true;
+            default: return false;
+        }
+    }
+
+    static bool isBranch(Instruction::Type type)
+    {
+        switch(type) {
+            case Instruction::BEQ: case Instruction::BNE:
+            case Instruction::BLTZ: case Instruction::BGEZ: case Instruction::BLEZ: case Instruction::BGTZ: return true;
+            default: return false;
+        }
+    }
+
+    // The branch taken exactly when the given one isn't
+    static Instruction::Type invertBranch(Instruction::Type type)
+    {
+        switch(type) {
+            case Instruction::BEQ: return Instruction::BNE;
+            case Instruction::BNE: return Instruction::BEQ;
+            case Instruction::BLTZ: return Instruction::BGEZ;
+            case Instruction::BGEZ: return Instruction::BLTZ;
+            case Instruction::BLEZ: return Instruction::BGTZ;
+            default: return Instruction::BLEZ;
+        }
+    }
+
+    // True if op always branches (beq $x, $x, ...)
+    static bool isJump(const Op& op)
+    {
+        return op.kind == Op::INSTR && op.type == Instruction::BEQ && op.s == op.t;
+    }
+
 private:
-    struct Patch
+    std::vector<Op> code;
+
+    // Number of words in code (labels take up none)
+    size_t wordCount = 0;
+
+    // Labels and words laid out after the code
+    std::vector<Op> rodataOps;
+
+    // Labels for zeroed words after the image, and how many words each has
+    std::vector<std::pair<std::string, int32_t>> bssWords;
+
+    std::unordered_set<std::string> labelNames;
+
+    // Words op takes up once encoded
+    static int getSize(const Op& op, bool isLong)
     {
-        enum Type
-        {
-            WORD,
-            BRANCH
-        };
+        if(!isLong) {
+            return 1;
+        }
 
-        Patch(Type type, size_t pos, std::string labelName) : type{type}, pos{pos}, labelName{std::move(labelName)} {}
+        // lis, .word and the load or store through it
+        if(isLoadStore(op.type)) {
+            return 3;
+        }
 
-        Type getType() const { return type; }
-        size_t getPos() const { return pos; }
-        const std::string& getLabelName() const { return labelName; }
-    
-    private:
-        Type type;
-        size_t pos;
-        std::string labelName;
-    };
-    
-    std::unordered_map<std::string, int> labels;
-    std::vector<Instruction> code;
-    std::vector<Patch> patches;
+        // lis, .word, jr, plus the inverted branch around them if it's conditional
+        return isJump(op) ? 3 : 4;
+    }
+
+    void addLabelName(const std::string& name)
+    {
+        if(!labelNames.insert(name).second) {
+            throw std::runtime_error{"Defined multiple labels with the name " + name};
+        }
+    }
+
+    void instr(Instruction::Type type, int s, int t, int d, int32_t imm = 0, std::string label = {})
+    {
+        push(Op{Op::INSTR, type, s, t, d, imm, std::move(label)});
+    }
 
-    Instruction wInst(int32_t value)
+    Instruction wInst(int32_t value) const
     {
         Instruction i;
         i.word = value;
@@ -338,22 +959,40 @@ private:
         return i;
     }
 
-    Instruction iInst(Instruction::Type type, int s, int t, int16_t imm)
+    Instruction iInst(Instruction::Type type, int s, int t, int16_t imm) const
     {
         Instruction i;
-        i.word = ((type & 0xf) << 28) | ((s & 0x1f) << 23) | ((t & 0x1f) << 18) | (imm & 0xffff);
+        i.word = ((type & 0x3f) << 26) | ((s & 0x1f) << 21) | ((t & 0x1f) << 16) | (imm & 0xffff);
 
         return i;
     }
 
-    Instruction rInst(Instruction::Type type, int s, int t, int d)
+    Instruction rInst(Instruction::Type type, int s, int t, int d) const
     {
         Instruction i;
-        i.word = ((type & 0xf) << 28) | ((s & 0x1f) << 23) | ((t & 0x1f) << 18) | ((d & 0x1f) << 13);
+        i.word = ((type & 0x3f) << 26) | ((s & 0x1f) << 21) | ((t & 0x1f) << 16) | ((d & 0x1f) << 11);
 
         return i;
     }
 
+    // A 16-bit immediate, signed unless it's going to be zero-extended
+    int32_t parseImm(const Pos& pos, const std::string& str, bool zeroExtended)
+    {
+        long long value;
+
+        try {
+            value = std::stoll(str, nullptr, 0);
+        } catch(...) {
+            throw PosError{pos, "Failed to convert to value: " + str};
+        }
+
+        if(zeroExtended ? (value < 0 || value > 0xffff) : (value < -32768 || value > 32767)) {
+            throw PosError{pos, "Immediate out of range: " + str};
+        }
+
+        return static_cast<int32_t>(value);
+    }
+
     int parseReg(const Pos& pos, const std::string& str)
     {
         if(str[0] != '$') {
@@ -1,6 +1,7 @@
 #include <ostream>
 #include <cassert>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 
 struct Compiler
@@ -17,28 +18,411 @@ struct Compiler
             compileStatement(table, *ast, gen);
         }
 
+        // Functions are only put in the code once they've all been compiled,
+        // so that each can be allocated after the functions it calls
+        for(auto& name : funcOrder) {
+            allocateFunc(name);
+        }
+
+        for(auto& name : funcOrder) {
+            gen.append(allocated[name]);
+        }
+
         // This is used by the default allocator in the runtime
         // to determine where it can start allocating memory
-        gen.labelHere("memStartXXXX");
+        gen.bss("memStartXXXX", 0);
     }
 
 private:
-    int curReg = 1;
+    // Next virtual register to hand out; these start over for every function
+    int curReg = FIRST_VREG;
     int labelIndex = 0;
 
     // The function we are compiling rn
     Func* curFunc = nullptr;
 
-    // TODO(Apaar): Actually, we probably don't always want to put retval in a single register
-    // because you could have multiple calls in a single statement. We'll return the register
-    // into which the result of the function call is returned. Get rid of this once that's set up
-    const int RETVAL_REG = 29;
- 
+    // Works out which pointers are to chars
+    Typer typer;
+
+    // Function code before and after register allocation
+    std::vector<std::string> funcOrder;
+    std::unordered_map<std::string, Codegen> bodies;
+    std::unordered_map<std::string, Codegen> allocated;
+
+    std::unordered_map<std::string, int32_t> localBytes;
+
+    // The loops in each function, innermost first
+    std::unordered_map<std::string, std::vector<Hoister::Loop>> loops;
+
+    // Functions whose locals are in fixed registers because they contain asm
+    std::unordered_set<std::string> asmFuncs;
+
+    // The registers each allocated function can change
+    std::unordered_map<std::string, RegMask> clobbers;
+
+    // Functions whose callees are being allocated
+    std::unordered_set<std::string> allocating;
+
     std::string uniqueLabel()
     {
         return "L" + std::to_string(labelIndex++);
     }
 
+    // Room taken by the current function's array literals so far
+    int32_t curLocalBytes = 0;
+
+    int newReg()
+    {
+        return curReg++;
+    }
+
+    // Inline asm refers to arguments and locals by register, so functions
+    // which have any get the old fixed layout instead of virtual registers
+    static bool containsAsm(const AST& ast)
+    {
+        switch(ast.getType()) {
+            case AST::ASM: return true;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    if(containsAsm(*a)) {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+                return containsAsm(ist.getBody()) || (ist.getAlt() && containsAsm(*ist.getAlt()));
+            }
+
+            case AST::WHILE: return containsAsm(static_cast<const WhileAST&>(ast).getBody());
+
+            default: return false;
+        }
+    }
+
+    // Loops that run a known number of times, no more than this, are unrolled...
+    static const int UNROLL_TRIPS = 8;
+
+    // ...as long as the copies of their body come to no more than this many statements
+    static const int UNROLL_STATEMENTS = 32;
+
+    static int countStatements(const AST& ast)
+    {
+        switch(ast.getType()) {
+            case AST::BLOCK: {
+                int count = 0;
+
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    count += countStatements(*a);
+                }
+
+                return count;
+            }
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+                return 1 + countStatements(ist.getBody()) + (ist.getAlt() ? countStatements(*ist.getAlt()) : 0);
+            }
+
+            case AST::WHILE: return 1 + countStatements(static_cast<const WhileAST&>(ast).getBody());
+
+            default: return 1;
+        }
+    }
+
+    // Counts the statements in ast which assign to name
+    static int countAssignments(const AST& ast, const std::string& name)
+    {
+        switch(ast.getType()) {
+            case AST::BIN: {
+                auto& lhs = static_cast<const BinAST&>(ast).getLhs();
+                return lhs.getType() == AST::ID && static_cast<const IdAST&>(lhs).getName() == name ? 1 : 0;
+            }
+
+            case AST::BLOCK: {
+                int count = 0;
+
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    count += countAssignments(*a, name);
+                }
+
+                return count;
+            }
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+                return countAssignments(ist.getBody(), name) + (ist.getAlt() ? countAssignments(*ist.getAlt(), name) : 0);
+            }
+
+            case AST::WHILE: return countAssignments(static_cast<const WhileAST&>(ast).getBody(), name);
+
+            default: return 0;
+        }
+    }
+
+    static bool getIntConst(const AST& ast, int64_t& value)
+    {
+        if(ast.getType() == AST::PAREN) {
+            return getIntConst(static_cast<const ParenAST&>(ast).getInner(), value);
+        }
+
+        if(ast.getType() != AST::INT && ast.getType() != AST::CHAR) {
+            return false;
+        }
+
+        value = static_cast<const IntAST&>(ast).getValue();
+        return true;
+    }
+
+    // How many times a loop like
+    //
+    //     i = 0;
+    //     while(i < 4) { ...; i = i + 1; }
+    //
+    // runs, given the statement before it, if it's small enough to unroll.
+    // Otherwise -1. The body has to change the local only at its very end.
+    int getTripCount(SymbolTable& table, const AST& init, const WhileAST& wst) const
+    {
+        if(!curFunc || init.getType() != AST::BIN || wst.getBody().getType() != AST::BLOCK) {
+            return -1;
+        }
+
+        auto& ist = static_cast<const BinAST&>(init);
+
+        int64_t start;
+
+        if(ist.getLhs().getType() != AST::ID || !getIntConst(ist.getRhs(), start)) {
+            return -1;
+        }
+
+        auto& name = static_cast<const IdAST&>(ist.getLhs()).getName();
+        auto var = table.getVar(name, curFunc);
+
+        // Globals could be changed by anything the body calls
+        if(!var || !var->func || containsAsm(wst.getBody())) {
+            return -1;
+        }
+
+        auto cond = &wst.getCond();
+
+        while(cond->getType() == AST::PAREN) {
+            cond = &static_cast<const ParenAST&>(*cond).getInner();
+        }
+
+        if(cond->getType() != AST::BIN) {
+            return -1;
+        }
+
+        auto& cst = static_cast<const BinAST&>(*cond);
+
+        int64_t limit;
+
+        if(cst.getLhs().getType() != AST::ID || static_cast<const IdAST&>(cst.getLhs()).getName() != name ||
+           !getIntConst(cst.getRhs(), limit)) {
+            return -1;
+        }
+
+        auto& body = static_cast<const BlockAST&>(wst.getBody()).getAsts();
+
+        if(body.empty() || countAssignments(wst.getBody(), name) != 1 || body.back()->getType() != AST::BIN) {
+            return -1;
+        }
+
+        // The last statement must be i = i + step or i = i - step
+        auto& last = static_cast<const BinAST&>(*body.back());
+
+        if(last.getLhs().getType() != AST::ID || static_cast<const IdAST&>(last.getLhs()).getName() != name ||
+           last.getRhs().getType() != AST::BIN) {
+            return -1;
+        }
+
+        auto& step = static_cast<const BinAST&>(last.getRhs());
+
+        int64_t amount;
+
+        if((step.getOp() != '+' && step.getOp() != '-') || step.getLhs().getType() != AST::ID ||
+           static_cast<const IdAST&>(step.getLhs()).getName() != name || !getIntConst(step.getRhs(), amount)) {
+            return -1;
+        }
+
+        if(step.getOp() == '-') {
+            amount = -amount;
+        }
+
+        // The machine only sees the low 32 bits of each constant
+        auto wrap = [](int64_t value) {
+            return static_cast<int64_t>(static_cast<int32_t>(static_cast<uint32_t>(value)));
+        };
+
+        start = wrap(start);
+        limit = wrap(limit);
+        amount = wrap(amount);
+
+        auto op = cst.getOp();
+
+        if(op != '<' && op != '>' && op != TOK_LTE && op != TOK_GTE && op != TOK_NOTEQUALS) {
+            return -1;
+        }
+
+        // Work out the trips by running it, wrapping like the machine does
+        auto holds = [&](int64_t i) {
+            switch(op) {
+                case '<': return i < limit;
+                case '>': return i > limit;
+                case TOK_LTE: return i <= limit;
+                case TOK_GTE: return i >= limit;
+                case TOK_NOTEQUALS: return i != limit;
+                default: return false;
+            }
+        };
+
+        int trips = 0;
+
+        for(auto i = start; holds(i); i = wrap(i + amount)) {
+            if(++trips > UNROLL_TRIPS) {
+                return -1;
+            }
+        }
+
+        if(trips * countStatements(wst.getBody()) > UNROLL_STATEMENTS) {
+            return -1;
+        }
+
+        return trips;
+    }
+
+    // Allocates registers for the callees of func first (except those it
+    // reaches through recursion), so its calls know what they change
+    void allocateFunc(const std::string& name)
+    {
+        if(allocated.count(name) || !allocating.insert(name).second) {
+            return;
+        }
+
+        auto& body = bodies[name];
+
+        for(auto& op : body.getCode()) {
+            if(op.kind == Codegen::Op::CALL) {
+                allocateFunc(op.label);
+            }
+        }
+
+        // The callees have had their own calls inlined by now, which may
+        // have left some of them small enough to inline here
+        if(!asmFuncs.count(name)) {
+            body = Inliner{bodies}.run(name, body);
+
+            Hoister{}.run(body, loops[name]);
+
+            // Arguments could point into the local arrays, which a tail
+            // call reuses or throws away
+            if(localBytes[name] == 0) {
+                eliminateTailCalls(name, body);
+            }
+        }
+
+        RegAlloc alloc{clobbers};
+
+        allocated[name] = alloc.run(name, body, localBytes[name]);
+        clobbers[name] = alloc.getClobbers();
+    }
+
+    // Turns calls whose result (if any) is returned straight away into
+    // jumps: back to the start of the body for calls to name itself, or
+    // into the callee in place of our own return. Those with arguments on
+    // the stack are left alone.
+    void eliminateTailCalls(const std::string& name, Codegen& body)
+    {
+        typedef Codegen::Op Op;
+
+        auto code = body.getCode();
+
+        std::unordered_map<std::string, size_t> labels;
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            if(code[i].kind == Op::LABEL) {
+                labels[code[i].label] = i;
+            }
+        }
+
+        auto isCopy = [&](size_t i, int d, int s) {
+            return i < code.size() && code[i].kind == Op::INSTR && code[i].type == Instruction::ADD &&
+                   code[i].t == 0 && (d < 0 || code[i].d == d) && (s < 0 || code[i].s == s);
+        };
+
+        // If the call at i is in tail position, the index of the first op
+        // after it (and the copies of its result out of $29 and back), else 0
+        auto getTailEnd = [&](size_t i) -> size_t {
+            if(code[i].kind != Op::CALL || code[i].imm > ARG_REG_COUNT) {
+                return 0;
+            }
+
+            auto next = i + 1;
+
+            if(isCopy(next, -1, RETVAL_REG) && code[next].d >= FIRST_VREG) {
+                auto copy = code[next].d;
+
+                ++next;
+
+                if(isCopy(next, RETVAL_REG, copy)) {
+                    ++next;
+                }
+            }
+
+            // Through any labels and jumps (like the one past an if's else)
+            auto ret = next;
+
+            for(size_t steps = 0; ret < code.size() && steps < code.size(); ++steps) {
+                if(code[ret].kind == Op::LABEL) {
+                    ++ret;
+                } else if(code[ret].kind == Op::INSTR && Codegen::isJump(code[ret]) && labels.count(code[ret].label)) {
+                    ret = labels[code[ret].label];
+                } else {
+                    break;
+                }
+            }
+
+            return ret < code.size() && code[ret].kind == Op::RET ? next : 0;
+        };
+
+        auto entry = name + "XXXXtailentry";
+
+        Codegen result;
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            if(code[i].label == name && getTailEnd(i)) {
+                result.labelHere(entry);
+                break;
+            }
+        }
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            auto& op = code[i];
+            auto end = getTailEnd(i);
+
+            if(!end) {
+                result.push(op);
+                continue;
+            }
+
+            // The arguments are already in $1 onwards, where the entry expects them
+            if(op.label == name) {
+                result.jump(entry);
+            } else {
+                result.tailCall(op.label, op.imm);
+            }
+
+            // The labels and return stay for any other code that reaches them
+            i = end - 1;
+        }
+
+        body = std::move(result);
+    }
+
     // Makes room for symbols and sets their location values
     void resolveSymbolLocations(SymbolTable& table, Codegen& gen)
     {
@@ -49,45 +433,101 @@ private:
         gen.lis(29, "main");
         gen.jr(29);
 
+        // Globals all start out zeroed, so they take no room in the image
         for(auto& v : table.globals) {
-            v.loc = gen.getPos();
-            gen.word(0);
+            gen.bss(getGlobalLabel(v.name), 1);
         }
 
-        for(auto& s : table.strings) {
-            s.loc = gen.getPos();
-            for(auto ch : s.str) {
-                gen.word(ch);
-            }
+        for(size_t i = 0; i < table.strings.size(); ++i) {
+            auto& str = table.strings[i].str;
 
-            // null-terminator
-            gen.word(0);
+            // Plus the null-terminator
+            gen.rodata(getStringLabel(static_cast<int>(i)), packBytes({str.begin(), str.end()}, str.size() + 1));
         }
-     
-        gen.labelHere("exitAddrGlobalXXXX");
-        gen.word(0);
 
-        for(auto& f : table.funcs) {
+        gen.bss("exitAddrGlobalXXXX", 1);
+    }
+
+    static std::string getGlobalLabel(const std::string& name)
+    {
+        return "globalXXXX" + name;
+    }
+
+    // Literals are interned, so each distinct string is only stored once
+    static std::string getStringLabel(int id)
+    {
+        return "stringXXXX" + std::to_string(id);
+    }
+
+    // Packs count bytes (bytes followed by zeros) four to a word, lowest
+    // address in the low byte to match lb and sb
+    static std::vector<int32_t> packBytes(const std::vector<int>& bytes, size_t count)
+    {
+        std::vector<int32_t> words((count + sizeof(Instruction) - 1) / sizeof(Instruction), 0);
+
+        for(size_t i = 0; i < bytes.size() && i < count; ++i) {
+            auto byte = static_cast<uint32_t>(static_cast<uint8_t>(bytes[i]));
+
+            words[i / sizeof(Instruction)] |= static_cast<int32_t>(byte << (i % sizeof(Instruction) * 8));
+        }
+
+        return words;
+    }
+
+    // chars are a byte each, so they're read and written with lb and sb
+    bool isBytePointer(SymbolTable& table, const AST& ast)
+    {
+        auto type = typer.getType(table, ast, curFunc);
+
+        return type->tag == Typetag::PTR && type->inner->tag == Typetag::CHAR;
+    }
+
+    // Gives the current function's arguments and locals their registers and
+    // copies the arguments out of the ones they were passed in
+    void resolveFuncLocations(Func& func, bool fixed, Codegen& gen)
+    {
+        if(fixed) {
             auto reg = 1;
 
-            for(auto& v : f.args) {
-                if(reg >= RETVAL_REG) {
-                    throw PosError{v.pos, "Function " + f.name + " takes too many arguments."};
+            for(auto& v : func.args) {
+                if(reg >= SCRATCH_REG_A) {
+                    throw PosError{v.pos, "Function " + func.name + " has too many arguments."};
+                }
+
+                if(reg > ARG_REG_COUNT) {
+                    gen.arg(reg, reg - 1 - ARG_REG_COUNT);
                 }
 
                 v.loc = reg++;
             }
 
-            for(auto& v : f.locals) {
-                if(reg >= RETVAL_REG) {
-                    throw PosError{v.pos, "Function " + f.name + " has too many locals."};
+            for(auto& v : func.locals) {
+                if(reg >= SCRATCH_REG_A) {
+                    throw PosError{v.pos, "Function " + func.name + " has too many locals."};
                 }
 
                 v.loc = reg++;
             }
 
-            // NOTE(Apaar): We use firstReg - 1 to store return value
-            f.firstReg = reg + 1;
+            return;
+        }
+
+        auto index = 0;
+
+        for(auto& v : func.args) {
+            v.loc = newReg();
+
+            if(index < ARG_REG_COUNT) {
+                gen.add(v.loc, index + 1, 0);
+            } else {
+                gen.arg(v.loc, index - ARG_REG_COUNT);
+            }
+
+            ++index;
+        }
+
+        for(auto& v : func.locals) {
+            v.loc = newReg();
         }
     }
 
@@ -103,106 +543,274 @@ private:
             throw PosError{ast.getPos(), "Incorrect amount of arguments supplied to " + ast.getFuncName() + "; expected " + std::to_string(func->args.size())};
         }
         
-        int spaceUsed = 0;
+        std::vector<int> argRegs;
 
-        // Store all the registers in use so far
-        for(int i = 1; i < curReg; ++i) {
-            spaceUsed += 4;
-            gen.sw(i, -spaceUsed, 30);
+        for(auto& arg : ast.getArgs()) {
+            argRegs.push_back(compileTerm(table, *arg, gen));
         }
- 
-        int prev = curReg;
 
-        // We'll use registers which are not in use by the function
-        // to store our temp args (because even if we stored them, when
-        // this call is being compiled, temporary values are being stored
-        // in them)
-        curReg = std::max(func->firstReg, curFunc ? curFunc->firstReg : 0);
+        // With asm, our own arguments and locals sit in $1... (see
+        // resolveFuncLocations), so those the moves below would overwrite are
+        // kept in virtual registers across the call
+        std::vector<std::pair<int, int>> kept;
 
-        int temp = curReg++;
+        if(curFunc) {
+            auto moved = std::min(static_cast<int>(argRegs.size()), ARG_REG_COUNT);
 
-        gen.lis(temp, spaceUsed);
-        gen.sub(30, 30, temp);
+            for(auto vars : {&curFunc->args, &curFunc->locals}) {
+                for(auto& v : *vars) {
+                    if(v.loc >= 1 && v.loc <= moved) {
+                        int reg = newReg();
 
-        curReg = temp;
+                        gen.add(reg, v.loc, 0);
+                        kept.emplace_back(v.loc, reg);
+                    }
+                }
+            }
+        }
 
-        // compile and assign arguments to the correct registers
-        
-        auto i = 0u;
-        for(auto& arg : ast.getArgs()) {
-            int reg = compileTerm(table, *arg, gen);
-            
-            gen.add(func->args[i].loc, reg, 0);
+        // Moved into place only once they're all evaluated, since evaluating
+        // one could involve another call. Those that don't fit in registers
+        // go at the bottom of our frame, where the callee expects them.
+        for(size_t i = 0; i < argRegs.size(); ++i) {
+            if(i < static_cast<size_t>(ARG_REG_COUNT)) {
+                gen.add(static_cast<int>(i + 1), argRegs[i], 0);
+            } else {
+                gen.sw(argRegs[i], static_cast<int16_t>((i - ARG_REG_COUNT) * sizeof(Instruction)), SP_REG);
+            }
+        }
+
+        gen.call(func->name, static_cast<int>(argRegs.size()));
+
+        int result = 0;
+
+        if(func->returnType->tag != Typetag::VOID) {
+            result = newReg();
+
+            gen.add(result, RETVAL_REG, 0);
+        }
+
+        for(auto& k : kept) {
+            gen.add(k.first, k.second, 0);
+        }
+
+        return result;
+    }
+    
+    // Branches to target if the condition comes out as jumpIf and falls
+    // through otherwise, without building a 0/1 value where it can help it.
+    // The right side of && and || is only evaluated when it's needed.
+    void compileCond(SymbolTable& table, const AST& ast, Codegen& gen, bool jumpIf, const std::string& target)
+    {
+        if(ast.getType() == AST::PAREN) {
+            compileCond(table, static_cast<const ParenAST&>(ast).getInner(), gen, jumpIf, target);
+            return;
+        }
 
-            // We are free to stomp that register now
-            curReg = reg;
-            i += 1;
+        if(ast.getType() == AST::BOOL) {
+            if((static_cast<const IntAST&>(ast).getValue() != 0) == jumpIf) {
+                gen.jump(target);
+            }
+
+            return;
+        }
+
+        if(ast.getType() != AST::BIN) {
+            int reg = compileTerm(table, ast, gen);
+
+            if(jumpIf) gen.bne(reg, 0, target);
+            else gen.beq(reg, 0, target);
+
+            return;
         }
 
-        // Jump into the function  
-        temp = std::max(func->firstReg, curFunc ? curFunc->firstReg : 0);
+        auto& bst = static_cast<const BinAST&>(ast);
+
+        auto op = bst.getOp();
+
+        if(op == TOK_LOGICAL_AND || op == TOK_LOGICAL_OR) {
+            // The left side alone decides it when it comes out as this
+            bool decides = op == TOK_LOGICAL_OR;
 
-        gen.lis(temp, func->name);
-        gen.jalr(temp);
+            if(decides == jumpIf) {
+                compileCond(table, bst.getLhs(), gen, jumpIf, target);
+                compileCond(table, bst.getRhs(), gen, jumpIf, target);
+            } else {
+                auto skipLabel = uniqueLabel();
 
-        curReg = prev;
+                compileCond(table, bst.getLhs(), gen, decides, skipLabel);
+                compileCond(table, bst.getRhs(), gen, jumpIf, target);
 
-        // Move return value (could be garbage if there is none) into temp reg
-        gen.add(curReg++, func->firstReg - 1, 0);
+                gen.labelHere(skipLabel);
+            }
 
-        temp = curReg++;
+            return;
+        }
 
-        // Restore regs
-        gen.lis(temp, spaceUsed);
-        gen.add(30, 30, temp);
+        if(op != TOK_EQUALS && op != TOK_NOTEQUALS && op != '<' && op != '>' && op != TOK_LTE && op != TOK_GTE) {
+            int reg = compileTerm(table, ast, gen);
 
-        curReg = temp;
+            if(jumpIf) gen.bne(reg, 0, target);
+            else gen.beq(reg, 0, target);
 
-        // -2 because we used an extra register to store the return value (but we didn't save that register)
-        for(int i = curReg - 2; i >= 1; --i) {
-            gen.lw(i, -spaceUsed, 30);
-            spaceUsed -= 4;
+            return;
         }
 
-        return curReg - 1;
+        int a = compileTerm(table, bst.getLhs(), gen);
+
+        int32_t imm;
+
+        if(op != TOK_EQUALS && op != TOK_NOTEQUALS && getImm(bst.getRhs(), imm)) {
+            // Comparisons with zero have branches of their own
+            if(imm == 0) {
+                auto type = op == '<' ? Instruction::BLTZ :
+                            op == TOK_GTE ? Instruction::BGEZ :
+                            op == TOK_LTE ? Instruction::BLEZ : Instruction::BGTZ;
+
+                gen.branch(jumpIf ? type : Codegen::invertBranch(type), a, 0, target);
+                return;
+            }
+
+            // a > imm is !(a < imm + 1) and a <= imm is a < imm + 1
+            bool plusOne = op == '>' || op == TOK_LTE;
+
+            if(!plusOne || imm < 32767) {
+                int less = newReg();
+
+                gen.slti(less, a, plusOne ? imm + 1 : imm);
+
+                if(jumpIf != (op == '>' || op == TOK_GTE)) gen.bne(less, 0, target);
+                else gen.beq(less, 0, target);
+
+                return;
+            }
+        }
+
+        int b = compileTerm(table, bst.getRhs(), gen);
+
+        if(op == TOK_EQUALS || op == TOK_NOTEQUALS) {
+            if(jumpIf == (op == TOK_EQUALS)) gen.beq(a, b, target);
+            else gen.bne(a, b, target);
+
+            return;
+        }
+
+        // a > b is b < a, a >= b is !(a < b) and a <= b is !(b < a)
+        bool swapped = op == '>' || op == TOK_LTE;
+        bool negated = op == TOK_GTE || op == TOK_LTE;
+
+        int less = newReg();
+
+        gen.slt(less, swapped ? b : a, swapped ? a : b);
+
+        if(jumpIf != negated) gen.bne(less, 0, target);
+        else gen.beq(less, 0, target);
     }
-    
+
+    // True (with the value) if ast is a constant which fits in an instruction's immediate
+    static bool getImm(const AST& ast, int32_t& value)
+    {
+        if(ast.getType() != AST::INT && ast.getType() != AST::CHAR && ast.getType() != AST::BOOL) {
+            return false;
+        }
+
+        auto v = static_cast<const IntAST&>(ast).getValue();
+
+        if(v < -32768 || v > 32767) {
+            return false;
+        }
+
+        value = static_cast<int32_t>(v);
+        return true;
+    }
+
+    // True (with k) if ast is the constant 2^k, for k from 0 to 30
+    static bool getShift(const AST& ast, int& k)
+    {
+        if(ast.getType() != AST::INT && ast.getType() != AST::CHAR) {
+            return false;
+        }
+
+        auto v = static_cast<const IntAST&>(ast).getValue();
+
+        for(k = 0; k <= 30; ++k) {
+            if(v == (int64_t{1} << k)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     // Returns the register index into which the term's result is stored
     int compileTerm(SymbolTable& table, const AST& ast, Codegen& gen)
     {
         if(ast.getType() == AST::INT || ast.getType() == AST::BOOL || ast.getType() == AST::CHAR) {
-			gen.lis(curReg++, static_cast<int32_t>(static_cast<const IntAST&>(ast).getValue()));
-
-            return curReg - 1;
-        } else if(ast.getType() == AST::ARRAY || ast.getType() == AST::ARRAY_STRING) {
-            auto startLabel = uniqueLabel();
-            auto endLabel = uniqueLabel();
+            int reg = newReg();
 
-            gen.lis(curReg++, endLabel);
-            gen.jr(curReg - 1);
+            gen.li(reg, static_cast<int32_t>(static_cast<const IntAST&>(ast).getValue()));
 
-            gen.labelHere(startLabel);
-            
+            return reg;
+        } else if(ast.getType() == AST::ARRAY || ast.getType() == AST::ARRAY_STRING) {
             auto& a = static_cast<const ArrayAST&>(ast);
     
             if(a.getLength() == 0) {
                 throw PosError{ast.getPos(), "Size of array literal must be > 0."};
             }
 
-            auto i = 0;
-            for(auto value : a.getValues()) {
-                gen.word(value);
-                ++i;
+            // Each activation gets its own copy in the function's frame,
+            // filled in every time the literal is evaluated
+            int reg = newReg();
+
+            gen.frameAddr(reg, curLocalBytes);
+
+            // Stores go through base, which moves along whenever the
+            // offset gets too big for a sw
+            int base = reg;
+            int32_t baseOffset = 0;
+
+            auto store = [&](int value, int32_t offset) {
+                if(offset - baseOffset > 32767) {
+                    int step = newReg();
+                    int next = newReg();
+
+                    gen.lis(step, offset - baseOffset);
+                    gen.add(next, base, step);
+
+                    base = next;
+                    baseOffset = offset;
+                }
+
+                gen.sw(value, static_cast<int16_t>(offset - baseOffset), base);
+            };
+
+            // Strings are packed a byte per char, and ints take a word each
+            std::vector<int32_t> words;
+
+            // The length is -1 when it's left out
+            auto count = std::max<size_t>(std::max(a.getLength(), 0), a.getValues().size());
+
+            if(ast.getType() == AST::ARRAY_STRING) {
+                words = packBytes(a.getValues(), count);
+            } else {
+                words.assign(a.getValues().begin(), a.getValues().end());
+                words.resize(count, 0);
             }
 
-            for(auto j = i; j < a.getLength(); ++j) {
-                gen.word(0);
+            for(size_t i = 0; i < words.size(); ++i) {
+                if(words[i] == 0) {
+                    store(0, i * sizeof(Instruction));
+                } else {
+                    int temp = newReg();
+
+                    gen.li(temp, words[i]);
+                    store(temp, i * sizeof(Instruction));
+                }
             }
 
-            gen.labelHere(endLabel);
-            gen.lis(curReg - 1, startLabel);
+            curLocalBytes += static_cast<int32_t>(words.size() * sizeof(Instruction));
 
-            return curReg - 1;
+            return reg;
         } else if(ast.getType() == AST::PAREN) {
             return compileTerm(table, static_cast<const ParenAST&>(ast).getInner(), gen);
         } else if(ast.getType() == AST::ID) {
@@ -214,35 +822,48 @@ private:
             }
 
             if(var->func) {
-                // HAHA no can't depend on this being saved properly when you're calling a function for example
-                // return var->loc;
+                // Copied so that assigning to the variable later can't change
+                // this value; the register allocator merges the two when it can
+                int reg = newReg();
 
-                // We move it into a temp reg we know works and then use that
-                gen.add(curReg++, var->loc, 0);
-                return curReg - 1;
+                gen.add(reg, var->loc, 0);
+                return reg;
             } else {
-                gen.lw(curReg++, var->loc, 0); 
-                return curReg - 1;
+                int reg = newReg();
+
+                gen.lw(reg, getGlobalLabel(var->name));
+                return reg;
             }
         } else if(ast.getType() == AST::CALL) {
             auto& cst = static_cast<const CallAST&>(ast);
 
             return compileCall(table, cst, gen);
         } else if(ast.getType() == AST::STR) {
-            gen.lis(curReg++, table.getString(static_cast<const StrAST&>(ast).getId()).loc);
-            return curReg - 1;
+            int reg = newReg();
+
+            gen.lis(reg, getStringLabel(static_cast<const StrAST&>(ast).getId()));
+            return reg;
         } else if(ast.getType() == AST::UNARY) {
             int reg = compileTerm(table, static_cast<const UnaryAST&>(ast).getRhs(), gen);
 
             switch(static_cast<const UnaryAST&>(ast).getOp()) {
                 case '-': {
-                    gen.sub(curReg++, 0, reg);
-                    return curReg - 1;
+                    int dest = newReg();
+
+                    gen.sub(dest, 0, reg);
+                    return dest;
                 } break;
 
                 case '*': {
-                    gen.lw(curReg++, 0, reg);
-                    return curReg - 1;
+                    int dest = newReg();
+
+                    if(isBytePointer(table, static_cast<const UnaryAST&>(ast).getRhs())) {
+                        gen.lb(dest, 0, reg);
+                    } else {
+                        gen.lw(dest, 0, reg);
+                    }
+
+                    return dest;
                 } break;
             }
         } else if(ast.getType() == AST::CAST) {
@@ -253,9 +874,109 @@ private:
 
         auto& bst = static_cast<const BinAST&>(ast);
 
-        int dest = curReg++;
+        int dest = newReg();
+
+        if(bst.getOp() == TOK_LOGICAL_AND || bst.getOp() == TOK_LOGICAL_OR) {
+            auto endLabel = uniqueLabel();
+
+            gen.add(dest, 0, 0);
+
+            compileCond(table, ast, gen, false, endLabel);
+
+            gen.li(dest, 1);
+
+            gen.labelHere(endLabel);
+
+            return dest;
+        }
+
+        int32_t imm;
+        int shift;
+
+        // Small constants go straight into the instruction
+        if(bst.getOp() == '+' && getImm(bst.getLhs(), imm)) {
+            gen.addi(dest, compileTerm(table, bst.getRhs(), gen), imm);
+            return dest;
+        }
+
+        // Multiplying by a power of two is a shift
+        if(bst.getOp() == '*' && getShift(bst.getLhs(), shift)) {
+            gen.sll(dest, compileTerm(table, bst.getRhs(), gen), shift);
+            return dest;
+        }
 
         int a = compileTerm(table, bst.getLhs(), gen);
+
+        if(getShift(bst.getRhs(), shift)) {
+            if(bst.getOp() == '*') {
+                gen.sll(dest, a, shift);
+                return dest;
+            }
+
+            // Shifting rounds down, so negative numbers get 2^k - 1 added
+            // first to round toward zero like div
+            if(bst.getOp() == '/' && shift > 0) {
+                int bias = newReg();
+                int biased = newReg();
+
+                if(shift == 1) {
+                    gen.srl(bias, a, 31);
+                } else {
+                    int sign = newReg();
+
+                    gen.sra(sign, a, 31);
+                    gen.srl(bias, sign, 32 - shift);
+                }
+
+                gen.add(biased, a, bias);
+                gen.sra(dest, biased, shift);
+                return dest;
+            }
+        }
+
+        if(getImm(bst.getRhs(), imm)) {
+            switch(bst.getOp()) {
+                case '+': gen.addi(dest, a, imm); return dest;
+                case '<': gen.slti(dest, a, imm); return dest;
+
+                // Shift amounts wrap at 32
+                case TOK_SHL: gen.sll(dest, a, imm & 31); return dest;
+                case TOK_SHR: gen.sra(dest, a, imm & 31); return dest;
+
+                // andi and ori zero-extend their immediate
+                case '&': {
+                    if(imm >= 0) {
+                        gen.andi(dest, a, imm);
+                        return dest;
+                    }
+                } break;
+
+                case '|': {
+                    if(imm >= 0) {
+                        gen.ori(dest, a, imm);
+                        return dest;
+                    }
+                } break;
+
+                case '-': {
+                    if(imm != -32768) {
+                        gen.addi(dest, a, -imm);
+                        return dest;
+                    }
+                } break;
+
+                case TOK_GTE: {
+                    int less = newReg();
+
+                    gen.slti(less, a, imm);
+                    gen.slti(dest, less, 1);
+                    return dest;
+                }
+
+                default: break;
+            }
+        }
+
         int b = compileTerm(table, bst.getRhs(), gen);
 
         switch(bst.getOp()) {
@@ -276,8 +997,14 @@ private:
                 gen.mfhi(dest);
             } break;
 
+            case '&': gen.and_(dest, a, b); break;
+            case '|': gen.or_(dest, a, b); break;
+            case '^': gen.xor_(dest, a, b); break;
+            case TOK_SHL: gen.sllv(dest, a, b); break;
+            case TOK_SHR: gen.srav(dest, a, b); break;
+
             case TOK_EQUALS: {
-                gen.lis(dest, 1);
+                gen.li(dest, 1);
 
                 // Set the result to 0 if they're not equal
                 gen.beq(a, b, 1);
@@ -285,7 +1012,7 @@ private:
             } break;
 
             case TOK_NOTEQUALS: {
-                gen.lis(dest, 1);
+                gen.li(dest, 1);
 
                 // Set the result to 0 if they're equal
                 gen.bne(a, b, 1);
@@ -297,72 +1024,28 @@ private:
             } break;
 
             case '>': {
-                gen.slt(dest, a, b);
-
-                int temp = curReg++;
-                gen.lis(temp, 1);
-
-                gen.sub(dest, temp, dest);
-
-                // dest reg=1 if greater than or equal to b
-
-                // we skip setting the dest to 0 if they're not equal
-                gen.bne(a, b, 1);
-                gen.add(dest, 0, 0);
+                gen.slt(dest, b, a);
             } break;
 
+            // slti x, 1 turns 0/1 into 1/0
             case TOK_LTE: {
-                gen.slt(dest, a, b);
+                int less = newReg();
 
-                // Set to 1 if they're equal
-                gen.bne(a, b, 2);
-                gen.lis(dest, 1);
+                gen.slt(less, b, a);
+                gen.slti(dest, less, 1);
             } break;
 
             case TOK_GTE: {
-                gen.slt(dest, a, b);
-
-                int temp = curReg++;
-                gen.lis(temp, 1);
-
-                gen.sub(dest, temp, dest);
-
-                // dest reg=1 if greater than or equal to b
-            } break;
-
-            case TOK_LOGICAL_AND: {
-                gen.lis(dest, 0);
+                int less = newReg();
 
-                gen.beq(a, 0, 3);
-                gen.beq(b, 0, 2);
-                gen.lis(dest, 1);
-            } break;
-
-            case TOK_LOGICAL_OR: {
-                gen.lis(dest, 1);
-
-                gen.bne(a, 0, 3);
-                gen.bne(b, 0, 2);
-                gen.lis(dest, 0);
+                gen.slt(less, a, b);
+                gen.slti(dest, less, 1);
             } break;
         }
 
-        curReg = dest + 1;
-
         return dest;
     }
 
-    void compileRestoreLinkAndSp(Codegen& gen)
-    {
-        int temp = curReg++;
-
-        gen.lis(temp, 4);
-        gen.add(30, 30, temp);
-        gen.lw(31, -4, 30);
-
-        curReg = temp;
-    }
-
     void compileStatement(SymbolTable& table, const AST& ast, Codegen& gen)
     {
         if(ast.getType() == AST::BIN) {
@@ -382,7 +1065,7 @@ private:
                 }
 
                 if(!var->func) {
-                    gen.sw(reg, var->loc, 0);
+                    gen.sw(reg, getGlobalLabel(var->name));
                 } else {
                     gen.add(var->loc, reg, 0);
                 }
@@ -395,35 +1078,43 @@ private:
 
                 int lreg = compileTerm(table, ust.getRhs(), gen);
 
-                gen.sw(reg, 0, lreg);
+                if(isBytePointer(table, ust.getRhs())) {
+                    gen.sb(reg, 0, lreg);
+                } else {
+                    gen.sw(reg, 0, lreg);
+                }
             }
-
-            // We're done with this register now that it's stored
-            curReg = reg;
         } else if(ast.getType() == AST::BLOCK) {
-            for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
-                compileStatement(table, *a, gen);
+            auto& asts = static_cast<const BlockAST&>(ast).getAsts();
+
+            for(size_t i = 0; i < asts.size(); ++i) {
+                if(i > 0 && asts[i]->getType() == AST::WHILE) {
+                    auto& wst = static_cast<const WhileAST&>(*asts[i]);
+
+                    int trips = getTripCount(table, *asts[i - 1], wst);
+
+                    if(trips >= 0) {
+                        for(int t = 0; t < trips; ++t) {
+                            compileStatement(table, wst.getBody(), gen);
+                        }
+
+                        continue;
+                    }
+                }
+
+                compileStatement(table, *asts[i], gen);
             }
         } else if(ast.getType() == AST::IF) {
             auto& ist = static_cast<const IfAST&>(ast);
 
-            int prevReg = curReg;
-
-            int cond = compileTerm(table, ist.getCond(), gen);
-
             auto altLabel = uniqueLabel();
             auto endLabel = uniqueLabel();
 
-            gen.beq(cond, 0, altLabel);
+            compileCond(table, ist.getCond(), gen, false, altLabel);
 
             compileStatement(table, ist.getBody(), gen);
 
-            int temp = curReg++;
-
-            gen.lis(temp, endLabel);
-            gen.jr(temp);
-
-            curReg = prevReg;
+            gen.jump(endLabel);
 
             gen.labelHere(altLabel);
             if(ist.getAlt()) {
@@ -434,28 +1125,24 @@ private:
         } else if(ast.getType() == AST::WHILE) {
             auto& ist = static_cast<const WhileAST&>(ast);
 
-            int prevReg = curReg;
-
-            auto condLabel = uniqueLabel();
-
-            gen.labelHere(condLabel);
-
-            int cond = compileTerm(table, ist.getCond(), gen);
-
+            auto topLabel = uniqueLabel();
             auto endLabel = uniqueLabel();
 
-            gen.beq(cond, 0, endLabel);
-
-            compileStatement(table, ist.getBody(), gen);
+            // Tested once on the way in and then at the bottom, so each trip
+            // around takes a single branch
+            compileCond(table, ist.getCond(), gen, false, endLabel);
 
-            int temp = curReg++;
+            gen.labelHere(topLabel);
 
-            gen.lis(temp, condLabel);
-            gen.jr(temp);
+            compileStatement(table, ist.getBody(), gen);
 
-            curReg = prevReg;
+            compileCond(table, ist.getCond(), gen, true, topLabel);
 
             gen.labelHere(endLabel);
+
+            if(curFunc) {
+                loops[curFunc->name].push_back(Hoister::Loop{topLabel, endLabel});
+            }
         } else if(ast.getType() == AST::FUNC) {
             auto& fst = static_cast<const FuncAST&>(ast);
         
@@ -463,36 +1150,31 @@ private:
             
             assert(curFunc);
 
-            int temp = curReg++;
-
-            gen.labelHere(curFunc->name);
+            curReg = FIRST_VREG;
+            curLocalBytes = 0;
 
-            // We can only use registers from firstReg onwards
-            int prev = curReg;
+            funcOrder.push_back(curFunc->name);
 
-            curReg = curFunc->firstReg;
+            auto& body = bodies[curFunc->name];
 
-            temp = curReg++;
+            bool hasAsm = containsAsm(fst.getBody());
 
-            gen.sw(31, -4, 30);
-            gen.lis(temp, 4);
-            gen.sub(30, 30, temp);
+            if(hasAsm) {
+                asmFuncs.insert(curFunc->name);
+            }
 
-            compileStatement(table, fst.getBody(), gen);
+            resolveFuncLocations(*curFunc, hasAsm, body);
 
-            // We are free to stop these regs now that the body of the function has been passed
-            curReg = prev;
+            compileStatement(table, fst.getBody(), body);
 
-            compileRestoreLinkAndSp(gen);
+            body.ret(false);
 
-            gen.jr(31);
+            localBytes[curFunc->name] = curLocalBytes;
 
             curFunc = nullptr;
         } else if(ast.getType() == AST::CALL) {
-            auto& cst = static_cast<const CallAST&>(ast);
-
             // Ignore return value
-            curReg = compileCall(table, cst, gen);
+            compileCall(table, static_cast<const CallAST&>(ast), gen);
         } else if(ast.getType() == AST::RETURN) {
             if(!curFunc) {
                 throw PosError{ast.getPos(), "You're trying to return but you're not inside a function. Think about that for a second."};
@@ -504,11 +1186,10 @@ private:
                 int res = compileTerm(table, *value, gen);
 
                 // Move the result into return value register
-                gen.add(curFunc->firstReg - 1, res, 0);
+                gen.add(RETVAL_REG, res, 0);
             }
 
-            compileRestoreLinkAndSp(gen);
-            gen.jr(31);
+            gen.ret(value != nullptr);
         } else if(ast.getType() == AST::ASM) {
             gen.parse(ast.getPos(), static_cast<const AsmAST&>(ast).getCode());
         } else {
@@ -0,0 +1,195 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+// Device registers live at the top of the address space
+const uint32_t mmioBase = 0xffff0000;
+
+const int32_t getcAddress = 0xffff0004;
+const int32_t putcAddress = 0xffff000c;
+
+// Block transfers: store a guest address to blockAddrAddress, then store a
+// count to blockWriteAddress to print that many chars (one per byte), or to
+// blockReadAddress to read up to that many chars into consecutive bytes.
+// A read stops after a newline or at end of input; loading blockReadAddress
+// gives the number of chars the last read stored.
+const int32_t blockAddrAddress = 0xffff0010;
+const int32_t blockWriteAddress = 0xffff0014;
+const int32_t blockReadAddress = 0xffff0018;
+
+// The guest's console. Input and output go through large host-side buffers
+// so a char costs a copy instead of a locked stdio call. A null input stream
+// behaves like an empty file.
+struct Console
+{
+    Console(FILE* in, FILE* out) :
+        in{in}, out{out},
+        inTty{in && isatty(fileno(in)) != 0}, outTty{isatty(fileno(out)) != 0},
+        inBuf(BUF_SIZE), outBuf(BUF_SIZE)
+    {
+    }
+
+    ~Console()
+    {
+        flush();
+    }
+
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    int getc()
+    {
+        if(inPos == inLen && !fill()) {
+            return EOF;
+        }
+
+        return static_cast<unsigned char>(inBuf[inPos++]);
+    }
+
+    void putc(int c)
+    {
+        if(outLen == outBuf.size()) {
+            flush();
+        }
+
+        outBuf[outLen++] = static_cast<char>(c);
+
+        if(c == '\n' && outTty) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if(outLen > 0) {
+            fwrite(&outBuf[0], 1, outLen, out);
+            outLen = 0;
+        }
+
+        fflush(out);
+    }
+
+    // Handles a load from a device register
+    int32_t load(int32_t addr)
+    {
+        switch(addr) {
+            case getcAddress: return getc();
+            case blockAddrAddress: return blockAddr;
+            case blockReadAddress: return lastReadCount;
+            default: throw std::runtime_error{"Invalid load from device address " + std::to_string(static_cast<uint32_t>(addr))};
+        }
+    }
+
+    // Handles a store to a device register. Returns the number of bytes of
+    // guest memory it wrote, starting at getBlockAddr(). Block transfers XOR
+    // each byte's address with byteSwap (see byteSwap() in emulator.cc).
+    int32_t store(int32_t addr, int32_t value, Memory& mem, int32_t byteSwap)
+    {
+        switch(addr) {
+            case putcAddress: putc(value); return 0;
+            case blockAddrAddress: blockAddr = value; return 0;
+
+            case blockWriteAddress: {
+                checkBlock(value, mem);
+
+                for(int32_t i = 0; i < value; ++i) {
+                    putc(mem.loadByte((blockAddr + i) ^ byteSwap));
+                }
+            } return 0;
+
+            case blockReadAddress: {
+                checkBlock(value, mem);
+
+                lastReadCount = 0;
+
+                while(lastReadCount < value) {
+                    int c = getc();
+
+                    if(c == EOF) {
+                        break;
+                    }
+
+                    mem.storeByte((blockAddr + lastReadCount) ^ byteSwap, c);
+                    lastReadCount += 1;
+
+                    if(c == '\n') {
+                        break;
+                    }
+                }
+            } return lastReadCount;
+
+            default: throw std::runtime_error{"Invalid store to device address " + std::to_string(static_cast<uint32_t>(addr))};
+        }
+    }
+
+    int32_t getBlockAddr() const { return blockAddr; }
+    int32_t getLastReadCount() const { return lastReadCount; }
+
+    // Puts the block registers back the way a snapshot saw them
+    void restoreBlockState(int32_t addr, int32_t readCount)
+    {
+        blockAddr = addr;
+        lastReadCount = readCount;
+    }
+
+private:
+    static const size_t BUF_SIZE = 1 << 16;
+
+    FILE* in;
+    FILE* out;
+
+    bool inTty, outTty;
+
+    std::vector<char> inBuf;
+    size_t inPos = 0, inLen = 0;
+
+    std::vector<char> outBuf;
+    size_t outLen = 0;
+
+    int32_t blockAddr = 0;
+    int32_t lastReadCount = 0;
+
+    bool fill()
+    {
+        if(!in) {
+            return false;
+        }
+
+        if(inTty) {
+            // Don't leave a prompt sitting in the buffer while we block
+            flush();
+
+            if(!fgets(&inBuf[0], static_cast<int>(inBuf.size()), in)) {
+                return false;
+            }
+
+            inLen = strlen(&inBuf[0]);
+        } else {
+            inLen = fread(&inBuf[0], 1, inBuf.size(), in);
+        }
+
+        inPos = 0;
+
+        return inLen > 0;
+    }
+
+    // Makes sure count bytes starting at blockAddr are in guest memory
+    void checkBlock(int32_t count, const Memory& mem)
+    {
+        if(count < 0 || blockAddr < 0 ||
+           static_cast<uint64_t>(blockAddr) + static_cast<uint64_t>(count) > mem.getSize()) {
+            throw std::runtime_error{"Block transfer of " + std::to_string(count) + " bytes at " + std::to_string(blockAddr) + " is out of bounds"};
+        }
+    }
+};
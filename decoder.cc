@@ -1,134 +1,119 @@
 #include <vector>
 
-std::vector<Instruction> decodeMips(const uint8_t* prog, size_t progLen)
+// MIPS32 programs are kept in guest memory just as they're loaded (as
+// big-endian words), so loads see their data unchanged. The engines translate
+// each word into the internal encoding when they fetch it as an instruction.
+// Only the instructions the emulator has are recognized, and they keep their
+// operands, so addresses (including jump targets loaded with lis) and branch
+// offsets mean the same thing in both forms.
+
+// Reads a big-endian MIPS32 image into words
+std::vector<Instruction> readMips(const uint8_t* prog, size_t progLen)
 {
-    // TODO(Apaar): Implement this
-    return {};
-
-#if 0
-    // This is code that could be useful in the decoding
-    uint32_t instr = static_cast<uint32_t>(mem[pc]);
-
-    auto startBits = (instr >> 26) & 0x3f;
-
-    auto sReg = (instr >> 21) & 0x3f;
-    auto tReg = (instr >> 16) & 0x3f;
-    auto dReg = (instr >> 11) & 0x3f;
-
-    auto endBits = instr & 0x7ff;
-
-    auto imm = instr & 0xffff;
-
-    if(startBits == 0) {
-        // add, sub, mult, div, mfhi, lis, slt, jr, jalr
-
-        switch(endBits) {
-            case 0x20: {
-                // add
-                regs[dReg] = regs[sReg] + regs[tReg];
-                pc += 4;
-            } break;
-
-            case 0x22: {
-                // sub
-                regs[dReg] = regs[sReg] - regs[tReg];
-                pc += 4;
-            } break;
-
-            case 0x18: {
-                // mult
-                int64_t r = static_cast<int64_t>(regs[sReg]) * static_cast<int64_t>(regs[tReg]);
+    if(progLen % sizeof(Instruction) != 0) {
+        throw std::runtime_error{"MIPS program is " + std::to_string(progLen) + " bytes, which isn't a whole number of words"};
+    }
 
-                hi = static_cast<int32_t>(r >> 32);
-                lo = static_cast<int32_t>(r);
+    std::vector<Instruction> code(progLen / sizeof(Instruction));
 
-                pc += 4;
-            } break;
+    for(size_t i = 0; i < code.size(); ++i) {
+        auto bytes = &prog[i * sizeof(Instruction)];
 
-            case 0x1a: {
-                // div
-                lo = regs[sReg] / regs[tReg];
-                hi = regs[sReg] % regs[tReg];
+        uint32_t word = (static_cast<uint32_t>(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
 
-                pc += 4;
-            } break;
+        code[i].word = static_cast<int32_t>(word);
+    }
 
-            case 0x10: {
-                // mfhi
-                regs[dReg] = hi;
+    return code;
+}
 
-                pc += 4;
-            } break;
+// Translates one MIPS32 instruction. Anything that isn't a supported
+// instruction comes out with an opcode no internal instruction has, so it
+// traps as invalid if it's ever run.
+Instruction decodeMips(uint32_t instr)
+{
+    auto encode = [](Instruction::Type type, uint32_t s, uint32_t t, uint32_t d, uint32_t imm) {
+        Instruction i;
+        i.word = static_cast<int32_t>((type << 26) | (s << 21) | (t << 16) | (d << 11) | (imm & 0xffff));
 
-            case 0x12: {
-                // mflo
-                regs[dReg] = lo;
+        return i;
+    };
 
-                pc += 4;
-            } break;
+    const Instruction invalid{static_cast<int32_t>(0xfc000000)};
 
-            case 0x14: {
-                // lis
-                pc += 4;
+    auto opcode = instr >> 26;
 
-                regs[dReg] = *static_cast<int32_t*>(&mem[pc]);
+    auto s = (instr >> 21) & 0x1f;
+    auto t = (instr >> 16) & 0x1f;
+    auto d = (instr >> 11) & 0x1f;
 
-                pc += 4;
-            } break;
+    auto imm = instr & 0xffff;
 
-            case 0x2A: {
-                // slt
-                regs[dReg] = regs[sReg] < regs[tReg];
+    if(opcode == 0) {
+        auto shamt = (instr >> 6) & 0x1f;
+        auto funct = instr & 0x3f;
 
-                pc += 4;
-            } break;
+        // The shifts by a constant take it from the shift amount (and their
+        // operand from t); it's always zero for the rest
+        if(funct == 0x00 || funct == 0x02 || funct == 0x03) {
+            if(s != 0) {
+                return invalid;
+            }
 
-            case 0x08: {
-                // jr
-                if(regs[sReg] == exitAddress) {
-                    // Done!
-                    return;
-                }
+            auto type = funct == 0x00 ? Instruction::SLL : funct == 0x02 ? Instruction::SRL : Instruction::SRA;
+            return encode(type, t, d, 0, shamt);
+        }
 
-                pc = regs[sReg];
-            } break;
+        if(shamt != 0) {
+            return invalid;
+        }
 
-            case 0x09: {
-                int32_t temp = regs[sReg];
-                regs[31] = pc;
-                pc = temp;
-            } break;
+        switch(funct) {
+            case 0x20: return encode(Instruction::ADD, s, t, d, 0);
+            case 0x22: return encode(Instruction::SUB, s, t, d, 0);
+            case 0x2a: return encode(Instruction::SLT, s, t, d, 0);
+            case 0x18: return encode(Instruction::MULT, s, t, 0, 0);
+            case 0x1a: return encode(Instruction::DIV, s, t, 0, 0);
+            case 0x10: return encode(Instruction::MFHI, 0, 0, d, 0);
+            case 0x12: return encode(Instruction::MFLO, 0, 0, d, 0);
+            case 0x08: return encode(Instruction::JR, s, 0, 0, 0);
+            case 0x09: return encode(Instruction::JALR, s, 0, 0, 0);
+            case 0x24: return encode(Instruction::AND, s, t, d, 0);
+            case 0x25: return encode(Instruction::OR, s, t, d, 0);
+            case 0x26: return encode(Instruction::XOR, s, t, d, 0);
+
+            // sllv/srav $d, $t, $s shift $t by $s
+            case 0x04: return encode(Instruction::SLLV, t, s, d, 0);
+            case 0x07: return encode(Instruction::SRAV, t, s, d, 0);
+
+            // The constant is the next word, which is never fetched
+            case 0x14: return encode(Instruction::LIS, 0, 0, d, 0);
         }
     } else {
-        // lw, sw, beq
-
-        switch(startBits) {
-            case 0x23: {
-                // lw
-                int32_t addr = imm + regs[sReg];
-
-                // TODO(Apaar): Check for unaligned reads
-
-                if(addr == getcAddress) {
-                    regs[tReg] = getchar();
-                } else {
-                    regs[tReg] = *static_cast<int32_t*>(&mem[addr]);
-                }
-            } break;
-
-            case 0x2B: {
-                // sw
-                int32_t addr = imm + regs[sReg];
-
-                // TODO(Apaar): Check for unaligned writes
-
-                if(addr == putcAddress) {
-                    putchar(regs[tReg]);
-                } else {
-                    *static_cast<int32_t*>(&mem[addr]) = regs[tReg];
-                }
+        switch(opcode) {
+            case 0x23: return encode(Instruction::LW, s, t, 0, imm);
+            case 0x2b: return encode(Instruction::SW, s, t, 0, imm);
+            case 0x20: return encode(Instruction::LB, s, t, 0, imm);
+            case 0x28: return encode(Instruction::SB, s, t, 0, imm);
+            case 0x04: return encode(Instruction::BEQ, s, t, 0, imm);
+            case 0x05: return encode(Instruction::BNE, s, t, 0, imm);
+            case 0x06: if(t == 0) return encode(Instruction::BLEZ, s, 0, 0, imm); break;
+            case 0x07: if(t == 0) return encode(Instruction::BGTZ, s, 0, 0, imm); break;
+
+            // addi traps on overflow in MIPS; here both wrap
+            case 0x08: case 0x09: return encode(Instruction::ADDI, s, t, 0, imm);
+            case 0x0a: return encode(Instruction::SLTI, s, t, 0, imm);
+            case 0x0c: return encode(Instruction::ANDI, s, t, 0, imm);
+            case 0x0d: return encode(Instruction::ORI, s, t, 0, imm);
+            case 0x0f: if(s == 0) return encode(Instruction::LUI, 0, t, 0, imm); break;
+
+            // REGIMM: the t field picks bltz or bgez
+            case 0x01: {
+                if(t == 0) return encode(Instruction::BLTZ, s, 0, 0, imm);
+                if(t == 1) return encode(Instruction::BGEZ, s, 0, 0, imm);
             } break;
         }
     }
-#endif
+
+    return invalid;
 }
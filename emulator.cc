@@ -1,6 +1,10 @@
 #include <string>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
 
 struct Instruction
 {
@@ -11,163 +15,956 @@ struct Instruction
         MFHI, MFLO,
         LW, SW,
         BEQ, BNE,
-        JR, JALR
+        JR, JALR,
+
+        // $t = $s + imm, $t = $s < imm, $t = imm << 16 and $t = $s | (unsigned)imm
+        ADDI, SLTI, LUI, ORI,
+
+        // Branch when $s is < 0, >= 0, <= 0 or > 0
+        BLTZ, BGEZ, BLEZ, BGTZ,
+
+        // $d = $s op $t, shifting by the low five bits of $t
+        AND, OR, XOR, SLLV, SRAV,
+
+        // $t = $s & (unsigned)imm, and shifts of $s by the low five bits of imm
+        ANDI, SLL, SRA, SRL,
+
+        // Loads the (sign-extended) byte at $s + imm into $t, and stores the low byte of $t there
+        LB, SB
     };
 
     // rFormat:
-    // oooo ssss sttt ttdd ddd0 0000 0000 0000
+    // oooo ooss ssst tttt dddd d000 0000 0000
     // iFormat:
-    // oooo ssss sttt tt00 iiii iiii iiii iiii
+    // oooo ooss ssst tttt iiii iiii iiii iiii
     int32_t word;
 
     Type getType() const
     {
-        return static_cast<Type>((word >> 28) & 0xf);
+        return static_cast<Type>((word >> 26) & 0x3f);
     }
 
-    uint8_t getS() const { return (word >> 23) & 0x1f; }
-    uint8_t getT() const { return (word >> 18) & 0x1f; }
-    uint8_t getD() const { return (word >> 13) & 0x1f; }
+    uint8_t getS() const { return (word >> 21) & 0x1f; }
+    uint8_t getT() const { return (word >> 16) & 0x1f; }
+    uint8_t getD() const { return (word >> 11) & 0x1f; }
 
     int16_t getImm() const { return word & 0xffff; }
 };
 
-void run(const Instruction* code, size_t codeSize)
-{    
+const int32_t exitAddress = -1;
+
+// A store to this device register asks for a snapshot of the machine (see snapshot.cc)
+const int32_t checkpointAddress = 0xffff0020;
+
+const size_t defaultMemSize = 16 << 20;
+
+// Writes to $0 are redirected to this register so the engines never have to re-zero $0
+const int SINK_REG = 32;
+
+struct Cpu
+{
+    int32_t regs[SINK_REG + 1];
+    int32_t lo, hi;
+    int32_t pc;
+};
+
+// See decoder.cc
+Instruction decodeMips(uint32_t instr);
+
+// MIPS32 images hold big-endian words, which are kept as host words, so the
+// byte at a MIPS address is at that address XORed with this
+inline int32_t byteSwap(bool mips)
+{
+    return mips ? 3 : 0;
+}
+
+// Reads the instruction at addr, translating it if the image is MIPS32
+inline Instruction fetch(Memory& mem, int32_t addr, bool mips)
+{
+    Instruction instr{mem.load(addr)};
+
+    return mips ? decodeMips(static_cast<uint32_t>(instr.word)) : instr;
+}
+
+// Copies the image into guest memory and sets up the special registers.
+// The stack starts at the top of memory.
+void loadImage(const Instruction* code, size_t codeSize, Memory& mem, Cpu& cpu)
+{
+    if(codeSize > mem.getSize()) {
+        throw std::runtime_error{"Program (" + std::to_string(codeSize) + " bytes) doesn't fit in " + std::to_string(mem.getSize()) + " bytes of memory"};
+    }
+
+    mem.write(0, code, codeSize);
+
+    cpu = {};
+
+    cpu.regs[30] = static_cast<int32_t>(mem.getSize());
+    cpu.regs[31] = exitAddress;
+}
+
+// A span of guest memory written by an instruction
+struct MemRange
+{
+    int32_t addr;
+    int32_t size;
+};
+
+// What step() did besides updating registers
+struct StepResult
+{
+    MemRange stored;    // Guest memory the instruction stored to, if any
+    bool checkpoint;    // The instruction asked for a snapshot
+};
+
+// Whether a BLTZ, BGEZ, BLEZ or BGTZ on value is taken
+inline bool branchesOnZero(Instruction::Type type, int32_t value)
+{
+    switch(type) {
+        case Instruction::BLTZ: return value < 0;
+        case Instruction::BGEZ: return value >= 0;
+        case Instruction::BLEZ: return value <= 0;
+        default: return value > 0;
+    }
+}
+
+// Executes the single instruction at cpu.pc straight out of memory. The
+// faster engines fall back to this for anything they don't handle themselves.
+StepResult step(Cpu& cpu, Memory& mem, Console& console, bool mips)
+{
+    const int32_t isize = sizeof(Instruction);
+
+    auto instr = fetch(mem, cpu.pc, mips);
+
+    auto s = instr.getS();
+    auto t = instr.getT();
+    auto d = instr.getD();
+
+    int16_t imm = instr.getImm();
+
+    auto& regs = cpu.regs;
+
+    StepResult result{{0, 0}, false};
+
+    switch(instr.getType()) {
+        default: {
+            throw std::runtime_error{"Invalid instruction at address " + std::to_string(cpu.pc)};
+        } break;
+
+        case Instruction::LIS: {
+            cpu.pc += isize;
+            regs[d] = mem.load(cpu.pc);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::ADD: {
+            regs[d] = regs[s] + regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SUB: {
+            regs[d] = regs[s] - regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::MULT: {
+            int64_t result = static_cast<int64_t>(regs[s]) * regs[t];
+            cpu.lo = static_cast<int32_t>(result);
+            cpu.hi = static_cast<int32_t>(result >> 32);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::DIV: {
+            cpu.lo = regs[s] / regs[t];
+            cpu.hi = regs[s] % regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SLT: {
+            regs[d] = regs[s] < regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::MFHI: {
+            regs[d] = cpu.hi;
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::MFLO: {
+            regs[d] = cpu.lo;
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::LW: {
+            int32_t addr = regs[s] + imm;
+
+            if(static_cast<uint32_t>(addr) >= mmioBase) {
+                regs[t] = console.load(addr);
+            } else {
+                regs[t] = mem.load(addr);
+            }
+
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SW: case Instruction::SB: {
+            int32_t addr = regs[s] + imm;
+
+            // Device registers take byte stores the same as word ones
+            if(addr == checkpointAddress) {
+                result.checkpoint = true;
+            } else if(static_cast<uint32_t>(addr) >= mmioBase) {
+                result.stored = {console.getBlockAddr(), console.store(addr, regs[t], mem, byteSwap(mips))};
+            } else if(instr.getType() == Instruction::SB) {
+                addr ^= byteSwap(mips);
+                mem.storeByte(addr, regs[t]);
+
+                result.stored = {addr, 1};
+            } else {
+                mem.store(addr, regs[t]);
+
+                result.stored = {addr, isize};
+            }
+
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::LB: {
+            int32_t addr = regs[s] + imm;
+
+            if(static_cast<uint32_t>(addr) >= mmioBase) {
+                regs[t] = console.load(addr);
+            } else {
+                regs[t] = mem.loadByte(addr ^ byteSwap(mips));
+            }
+
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::BEQ: {
+            cpu.pc += isize;
+            if(regs[s] == regs[t]) {
+                cpu.pc += imm * isize;
+            }
+        } break;
+
+        case Instruction::BNE: {
+            cpu.pc += isize;
+            if(regs[s] != regs[t]) {
+                cpu.pc += imm * isize;
+            }
+        } break;
+
+        case Instruction::JR: {
+            cpu.pc = regs[s];
+        } break;
+
+        case Instruction::ADDI: {
+            regs[t] = static_cast<int32_t>(static_cast<uint32_t>(regs[s]) + imm);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SLTI: {
+            regs[t] = regs[s] < imm;
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::LUI: {
+            regs[t] = static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(imm)) << 16);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::ORI: {
+            regs[t] = regs[s] | static_cast<uint16_t>(imm);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::BLTZ: case Instruction::BGEZ: case Instruction::BLEZ: case Instruction::BGTZ: {
+            cpu.pc += isize;
+            if(branchesOnZero(instr.getType(), regs[s])) {
+                cpu.pc += imm * isize;
+            }
+        } break;
+
+        case Instruction::AND: {
+            regs[d] = regs[s] & regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::OR: {
+            regs[d] = regs[s] | regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::XOR: {
+            regs[d] = regs[s] ^ regs[t];
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SLLV: {
+            regs[d] = static_cast<int32_t>(static_cast<uint32_t>(regs[s]) << (regs[t] & 31));
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SRAV: {
+            regs[d] = regs[s] >> (regs[t] & 31);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::ANDI: {
+            regs[t] = regs[s] & static_cast<uint16_t>(imm);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SLL: {
+            regs[t] = static_cast<int32_t>(static_cast<uint32_t>(regs[s]) << (imm & 31));
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SRA: {
+            regs[t] = regs[s] >> (imm & 31);
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::SRL: {
+            regs[t] = static_cast<int32_t>(static_cast<uint32_t>(regs[s]) >> (imm & 31));
+            cpu.pc += isize;
+        } break;
+
+        case Instruction::JALR: {
+            int32_t temp = regs[s];
+            regs[31] = cpu.pc + isize;
+            cpu.pc = temp;
+        } break;
+    }
+
+    regs[0] = 0;
+
+    return result;
+}
+
+// Computed goto is a GCC/Clang extension; other compilers fall back to a switch
+#if defined(__GNUC__)
+#define WAT_THREADED_DISPATCH 1
+#endif
+
+// An instruction with its operands already pulled out of the word. The whole
+// image is decoded into these up front so the dispatch loop doesn't have to.
+struct DecodedOp
+{
+    enum Type
+    {
+        // Values below this are the same as Instruction::Type
+        INVALID = Instruction::SB + 1,
+        OUT_OF_CODE,
+
+        // A LIS fused with the instruction after its constant, which uses the
+        // loaded register (t, or d for jumps) as an operand. They still set it.
+        ADD_IMM, SUB_IMM,
+        JR_IMM, JALR_IMM,
+
+        TYPE_COUNT
+    };
+
+    // Address of the handler label when using threaded dispatch
+    const void* handler;
+
+    // Sign-extended immediate (already shifted for LUI, zero-extended for
+    // ORI and ANDI and masked to a shift amount for shifts), the constant for LIS (and fused ops), or the target op index for branches
+    int32_t imm;
+
+    uint8_t type;
+    uint8_t s, t, d;
+};
+
+// The compiler loads constants to use them straight away: lis/.word/jr for
+// jumps, lis/.word/jalr for calls and lis/.word/add or sub for arithmetic
+// (including every stack adjustment). This turns the LIS op into one that
+// does the instruction after the constant as well, if it's one of those.
+void fuseLis(DecodedOp& op, Instruction use)
+{
+    auto r = op.d;
+
+    auto s = use.getS();
+    auto t = use.getT();
+    auto d = use.getD();
+
+    switch(use.getType()) {
+        case Instruction::JR: if(s == r) op.type = DecodedOp::JR_IMM; return;
+        case Instruction::JALR: if(s == r) op.type = DecodedOp::JALR_IMM; return;
+
+        case Instruction::ADD: {
+            // Either operand can be the constant, but not both
+            if((s == r) == (t == r)) return;
+
+            op.type = DecodedOp::ADD_IMM;
+            op.s = s == r ? t : s;
+        } break;
+
+        case Instruction::SUB: {
+            if(t != r || s == r) return;
+
+            op.type = DecodedOp::SUB_IMM;
+            op.s = s;
+        } break;
+
+        default: return;
+    }
+
+    op.t = r;
+    op.d = d == 0 ? SINK_REG : d;
+}
+
+DecodedOp decodeOp(Memory& mem, size_t codeWords, size_t index, bool mips, const void* const* handlers)
+{
     const size_t isize = sizeof(Instruction);
 
-    const int32_t exitAddress = -1;
-    const int32_t getcAddress = 0xffff0004;
-    const int32_t putcAddress = 0xffff000c;
-
-    int32_t lo = 0, hi = 0;
-    int32_t pc = 0;
-    int32_t regs[32] = { 0 };
-    
-    static uint8_t mem[1 << 16];
-
-    memcpy(mem, code, codeSize);
-
-    // Initialize the special registers
-    regs[30] = 1 << 16;
-    regs[31] = exitAddress;
- 
-    while(true) {
-        if(pc == exitAddress) {
-            return;
+    DecodedOp op;
+
+    auto instr = fetch(mem, static_cast<int32_t>(index * isize), mips);
+
+    op.type = instr.getType();
+    op.s = instr.getS();
+    op.t = instr.getT();
+    op.d = instr.getD();
+    op.imm = instr.getImm();
+
+    switch(op.type) {
+        case Instruction::LIS: {
+            // Fold the constant in; a LIS in the very last word of memory reads 0
+            auto next = (index + 1) * isize;
+            op.imm = next + isize <= mem.getSize() ? mem.load(static_cast<int32_t>(next)) : 0;
+
+            if(op.d == 0) {
+                op.d = SINK_REG;
+            } else if(index + 2 < codeWords) {
+                fuseLis(op, fetch(mem, static_cast<int32_t>((index + 2) * isize), mips));
+            }
+        } break;
+
+        case Instruction::ADD: case Instruction::SUB: case Instruction::SLT:
+        case Instruction::MFHI: case Instruction::MFLO:
+        case Instruction::AND: case Instruction::OR: case Instruction::XOR:
+        case Instruction::SLLV: case Instruction::SRAV: {
+            if(op.d == 0) op.d = SINK_REG;
+        } break;
+
+        case Instruction::LW: case Instruction::LB: case Instruction::ADDI: case Instruction::SLTI: {
+            if(op.t == 0) op.t = SINK_REG;
+        } break;
+
+        case Instruction::LUI: {
+            op.imm = static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(op.imm)) << 16);
+            if(op.t == 0) op.t = SINK_REG;
+        } break;
+
+        case Instruction::ORI: case Instruction::ANDI: {
+            op.imm = static_cast<uint16_t>(op.imm);
+            if(op.t == 0) op.t = SINK_REG;
+        } break;
+
+        case Instruction::SLL: case Instruction::SRA: case Instruction::SRL: {
+            op.imm &= 31;
+            if(op.t == 0) op.t = SINK_REG;
+        } break;
+
+        case Instruction::BEQ: case Instruction::BNE:
+        case Instruction::BLTZ: case Instruction::BGEZ: case Instruction::BLEZ: case Instruction::BGTZ: {
+            int64_t target = static_cast<int64_t>(index) + 1 + op.imm;
+
+            if(target < 0 || target >= static_cast<int64_t>(codeWords)) {
+                target = codeWords;
+            }
+
+            op.imm = static_cast<int32_t>(target);
+        } break;
+
+        case Instruction::MULT: case Instruction::DIV:
+        case Instruction::SW: case Instruction::SB: case Instruction::JR: case Instruction::JALR: break;
+
+        default: {
+            op.type = DecodedOp::INVALID;
+        } break;
+    }
+
+    op.handler = handlers ? handlers[op.type] : nullptr;
+
+    return op;
+}
+
+// Execution counts gathered by run() when profiling, indexed by code word
+struct ExecProfile
+{
+    std::vector<uint64_t> counts;   // Times the instruction at each word retired
+    std::vector<uint64_t> taken;    // Times the branch at each word was taken
+};
+
+// The threaded dispatch loop, starting at cpu.pc. Returns true if it stopped
+// at a checkpoint (with cpu.pc after it) or false once the program exits.
+// When Profile is false the counting compiles away entirely. Count just adds
+// the number of instructions retired to *retired, with a single counter.
+template<bool Profile, bool Count>
+bool interpret(Memory& mem, Cpu& cpu, Console& console, size_t codeSize, bool mips, ExecProfile* profile, uint64_t* retired)
+{
+    const int32_t isize = sizeof(Instruction);
+
+    auto& regs = cpu.regs;
+    auto& lo = cpu.lo;
+    auto& hi = cpu.hi;
+
+#ifdef WAT_THREADED_DISPATCH
+    static const void* const handlers[DecodedOp::TYPE_COUNT] = {
+        &&opLis,
+        &&opAdd, &&opSub, &&opMult, &&opDiv, &&opSlt,
+        &&opMfhi, &&opMflo,
+        &&opLw, &&opSw,
+        &&opBeq, &&opBne,
+        &&opJr, &&opJalr,
+        &&opAddi, &&opSlti, &&opLui, &&opOri,
+        &&opBltz, &&opBgez, &&opBlez, &&opBgtz,
+        &&opAnd, &&opOr, &&opXor, &&opSllv, &&opSrav,
+        &&opAndi, &&opSll, &&opSra, &&opSrl,
+        &&opLb, &&opSb,
+        &&opInvalid, &&opOutOfCode,
+        &&opAddImm, &&opSubImm,
+        &&opJrImm, &&opJalrImm
+    };
+
+    #define DISPATCH() do { if(Profile) ++counts[ip - &ops[0]]; if(Count) ++instructions; goto *ip->handler; } while(0)
+#else
+    const void* const* handlers = nullptr;
+
+    #define DISPATCH() do { if(Profile) ++counts[ip - &ops[0]]; if(Count) ++instructions; goto dispatch; } while(0)
+#endif
+
+    size_t codeWords = codeSize / isize;
+
+    const int32_t swap = byteSwap(mips);
+
+    // Two extra ops so that falling off the end (even from a LIS) lands on a sentinel
+    std::vector<DecodedOp> ops(codeWords + 2);
+
+    for(size_t i = 0; i < codeWords; ++i) {
+        ops[i] = decodeOp(mem, codeWords, i, mips, handlers);
+    }
+
+    for(size_t i = codeWords; i < ops.size(); ++i) {
+        ops[i].type = DecodedOp::OUT_OF_CODE;
+#ifdef WAT_THREADED_DISPATCH
+        ops[i].handler = handlers[DecodedOp::OUT_OF_CODE];
+#endif
+    }
+
+    uint64_t* counts = nullptr;
+    uint64_t* taken = nullptr;
+
+    if(Profile) {
+        // The extra slots are for the sentinels. Counts carry on across checkpoints.
+        profile->counts.resize(ops.size());
+        profile->taken.resize(ops.size());
+
+        counts = &profile->counts[0];
+        taken = &profile->taken[0];
+    }
+
+    uint64_t instructions = 0;
+
+    const DecodedOp* ip = &ops[cpu.pc / isize];
+    int32_t target = 0;
+    MemRange stored{0, 0};
+
+    DISPATCH();
+
+#ifndef WAT_THREADED_DISPATCH
+dispatch:
+    switch(ip->type) {
+        case Instruction::LIS: goto opLis;
+        case Instruction::ADD: goto opAdd;
+        case Instruction::SUB: goto opSub;
+        case Instruction::MULT: goto opMult;
+        case Instruction::DIV: goto opDiv;
+        case Instruction::SLT: goto opSlt;
+        case Instruction::MFHI: goto opMfhi;
+        case Instruction::MFLO: goto opMflo;
+        case Instruction::LW: goto opLw;
+        case Instruction::SW: goto opSw;
+        case Instruction::BEQ: goto opBeq;
+        case Instruction::BNE: goto opBne;
+        case Instruction::JR: goto opJr;
+        case Instruction::JALR: goto opJalr;
+        case Instruction::ADDI: goto opAddi;
+        case Instruction::SLTI: goto opSlti;
+        case Instruction::LUI: goto opLui;
+        case Instruction::ORI: goto opOri;
+        case Instruction::BLTZ: goto opBltz;
+        case Instruction::BGEZ: goto opBgez;
+        case Instruction::BLEZ: goto opBlez;
+        case Instruction::BGTZ: goto opBgtz;
+        case Instruction::AND: goto opAnd;
+        case Instruction::OR: goto opOr;
+        case Instruction::XOR: goto opXor;
+        case Instruction::SLLV: goto opSllv;
+        case Instruction::SRAV: goto opSrav;
+        case Instruction::ANDI: goto opAndi;
+        case Instruction::SLL: goto opSll;
+        case Instruction::SRA: goto opSra;
+        case Instruction::SRL: goto opSrl;
+        case Instruction::LB: goto opLb;
+        case Instruction::SB: goto opSb;
+        case DecodedOp::OUT_OF_CODE: goto opOutOfCode;
+        case DecodedOp::ADD_IMM: goto opAddImm;
+        case DecodedOp::SUB_IMM: goto opSubImm;
+        case DecodedOp::JR_IMM: goto opJrImm;
+        case DecodedOp::JALR_IMM: goto opJalrImm;
+        default: goto opInvalid;
+    }
+#endif
+
+opLis:
+    regs[ip->d] = ip->imm;
+    ip += 2;
+    DISPATCH();
+
+opAdd:
+    regs[ip->d] = regs[ip->s] + regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opSub:
+    regs[ip->d] = regs[ip->s] - regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opMult: {
+        int64_t result = static_cast<int64_t>(regs[ip->s]) * regs[ip->t];
+        lo = static_cast<int32_t>(result);
+        hi = static_cast<int32_t>(result >> 32);
+        ++ip;
+    }
+    DISPATCH();
+
+opDiv:
+    lo = regs[ip->s] / regs[ip->t];
+    hi = regs[ip->s] % regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opSlt:
+    regs[ip->d] = regs[ip->s] < regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opMfhi:
+    regs[ip->d] = hi;
+    ++ip;
+    DISPATCH();
+
+opMflo:
+    regs[ip->d] = lo;
+    ++ip;
+    DISPATCH();
+
+opLw: {
+        int32_t addr = regs[ip->s] + ip->imm;
+
+        if(static_cast<uint32_t>(addr) >= mmioBase) {
+            regs[ip->t] = console.load(addr);
+        } else {
+            regs[ip->t] = mem.load(addr);
+        }
+
+        ++ip;
+    }
+    DISPATCH();
+
+opSw: {
+        int32_t addr = regs[ip->s] + ip->imm;
+
+        stored = {addr, isize};
+
+        if(addr == checkpointAddress) {
+            cpu.pc = static_cast<int32_t>((ip - &ops[0] + 1) * isize);
+            if(Count) *retired += instructions;
+            return true;
+        } else if(static_cast<uint32_t>(addr) >= mmioBase) {
+            stored = {console.getBlockAddr(), console.store(addr, regs[ip->t], mem, swap)};
+        } else {
+            mem.store(addr, regs[ip->t]);
+        }
+    }
+
+    // String literals live in the image after the code, so a store there
+    // has to re-decode every op that could have read the bytes it touched
+redecode:
+    if(stored.size > 0 && static_cast<uint32_t>(stored.addr) < codeSize) {
+        size_t first = stored.addr / isize;
+        size_t last = std::min((static_cast<size_t>(stored.addr) + stored.size - 1) / isize, codeWords - 1);
+
+        // The two words before may be a LIS which folded this one in
+        first -= std::min<size_t>(first, 2);
+
+        for(auto i = first; i <= last; ++i) {
+            ops[i] = decodeOp(mem, codeWords, i, mips, handlers);
         }
+    }
+
+    ++ip;
+    DISPATCH();
+
+opLb: {
+        int32_t addr = regs[ip->s] + ip->imm;
+
+        if(static_cast<uint32_t>(addr) >= mmioBase) {
+            regs[ip->t] = console.load(addr);
+        } else {
+            regs[ip->t] = mem.loadByte(addr ^ swap);
+        }
+
+        ++ip;
+    }
+    DISPATCH();
 
-        auto instr = *reinterpret_cast<Instruction*>(&mem[pc]);
-        
-        auto s = instr.getS();
-        auto t = instr.getT();
-        auto d = instr.getD();
-
-        int16_t imm = instr.getImm();
-
-        regs[0] = 0;
-
-        switch(instr.getType()) {
-			default: {
-				throw std::runtime_error{ "Invalid instruction type: " + std::to_string(instr.getType()) };
-			} break;
-			
-            case Instruction::LIS: {
-                pc += isize;
-				regs[d] = *reinterpret_cast<int32_t*>(&mem[pc]);
-                pc += isize;
-            } break;
-
-            case Instruction::ADD: {
-                regs[d] = regs[s] + regs[t];
-                pc += isize;
-            } break;
-
-            case Instruction::SUB: {
-                regs[d] = regs[s] - regs[t];
-                pc += isize;
-            } break;
-
-            case Instruction::MULT: {
-                int64_t result = static_cast<int64_t>(regs[s]) * regs[t];
-                lo = static_cast<int32_t>(result);
-                hi = static_cast<int32_t>(result >> 32);
-                pc += isize;
-            } break;
-
-            case Instruction::DIV: {
-                lo = regs[s] / regs[t];
-                hi = regs[s] % regs[t];
-                pc += isize;
-            } break;
-
-            case Instruction::SLT: {
-                regs[d] = regs[s] < regs[t];
-                pc += isize;
-            } break;
-
-            case Instruction::MFHI: {
-                regs[d] = hi;
-                pc += isize;
-            } break;
-
-            case Instruction::MFLO: {
-                regs[d] = lo;
-                pc += isize;
-            } break;
-
-            case Instruction::LW: {
-				auto addr = regs[s];
-                addr += imm;
-                
-                if(addr == getcAddress) {
-                    regs[t] = getchar();
-                } else {
-					assert(addr >= 0);
-                    regs[t] = *reinterpret_cast<int32_t*>(&mem[addr]);
-                }
-
-                pc += isize;
-            } break;
-
-            case Instruction::SW: {
-                auto addr = regs[s];
-                addr += imm;
-                
-                if(addr == putcAddress) {
-                    putchar(regs[t]);
-                } else {
-					assert(addr >= 0);
-                    *reinterpret_cast<int32_t*>(&mem[addr]) = regs[t];
-                }
-
-                pc += isize;
-            } break;
-
-            case Instruction::BEQ: {
-                pc += isize;
-                if(regs[s] == regs[t]) {
-                    pc += imm * isize;
-                }
-            } break;
-
-            case Instruction::BNE: {
-                pc += isize;
-                if(regs[s] != regs[t]) {
-                    pc += imm * isize;
-                }
-            } break;
-
-            case Instruction::JR: {
-                pc = regs[s];
-            } break;
-
-            case Instruction::JALR: {
-				pc += isize;
-                int32_t temp = regs[s];
-                regs[31] = pc;
-                pc = temp;
-            } break;
+opSb: {
+        int32_t addr = regs[ip->s] + ip->imm;
+
+        // Device registers take byte stores the same as word ones
+        if(static_cast<uint32_t>(addr) >= mmioBase) {
+            goto opSw;
         }
+
+        addr ^= swap;
+        mem.storeByte(addr, regs[ip->t]);
+
+        stored = {addr, 1};
+    }
+    goto redecode;
+
+opBeq:
+    if(regs[ip->s] == regs[ip->t]) {
+        if(Profile) ++taken[ip - &ops[0]];
+        ip = &ops[ip->imm];
+    } else {
+        ++ip;
+    }
+    DISPATCH();
+
+opBne:
+    if(regs[ip->s] != regs[ip->t]) {
+        if(Profile) ++taken[ip - &ops[0]];
+        ip = &ops[ip->imm];
+    } else {
+        ++ip;
     }
+    DISPATCH();
+
+opAddi:
+    regs[ip->t] = static_cast<int32_t>(static_cast<uint32_t>(regs[ip->s]) + ip->imm);
+    ++ip;
+    DISPATCH();
+
+opSlti:
+    regs[ip->t] = regs[ip->s] < ip->imm;
+    ++ip;
+    DISPATCH();
+
+opLui:
+    regs[ip->t] = ip->imm;
+    ++ip;
+    DISPATCH();
+
+opOri:
+    regs[ip->t] = regs[ip->s] | ip->imm;
+    ++ip;
+    DISPATCH();
+
+    #define BRANCH_ON_ZERO(cond) do { \
+        if(regs[ip->s] cond 0) { \
+            if(Profile) ++taken[ip - &ops[0]]; \
+            ip = &ops[ip->imm]; \
+        } else { \
+            ++ip; \
+        } \
+    } while(0)
+
+opBltz:
+    BRANCH_ON_ZERO(<);
+    DISPATCH();
+
+opBgez:
+    BRANCH_ON_ZERO(>=);
+    DISPATCH();
+
+opBlez:
+    BRANCH_ON_ZERO(<=);
+    DISPATCH();
+
+opBgtz:
+    BRANCH_ON_ZERO(>);
+    DISPATCH();
+
+    #undef BRANCH_ON_ZERO
+
+opAnd:
+    regs[ip->d] = regs[ip->s] & regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opOr:
+    regs[ip->d] = regs[ip->s] | regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opXor:
+    regs[ip->d] = regs[ip->s] ^ regs[ip->t];
+    ++ip;
+    DISPATCH();
+
+opSllv:
+    regs[ip->d] = static_cast<int32_t>(static_cast<uint32_t>(regs[ip->s]) << (regs[ip->t] & 31));
+    ++ip;
+    DISPATCH();
+
+opSrav:
+    regs[ip->d] = regs[ip->s] >> (regs[ip->t] & 31);
+    ++ip;
+    DISPATCH();
+
+opAndi:
+    regs[ip->t] = regs[ip->s] & ip->imm;
+    ++ip;
+    DISPATCH();
+
+opSll:
+    regs[ip->t] = static_cast<int32_t>(static_cast<uint32_t>(regs[ip->s]) << ip->imm);
+    ++ip;
+    DISPATCH();
+
+opSra:
+    regs[ip->t] = regs[ip->s] >> ip->imm;
+    ++ip;
+    DISPATCH();
+
+opSrl:
+    regs[ip->t] = static_cast<int32_t>(static_cast<uint32_t>(regs[ip->s]) >> ip->imm);
+    ++ip;
+    DISPATCH();
+
+opJalr:
+    target = regs[ip->s];
+    regs[31] = static_cast<int32_t>((ip - &ops[0] + 1) * isize);
+    goto jump;
+
+opJr:
+    target = regs[ip->s];
+    goto jump;
+
+    // The fused ops count as both instructions
+opAddImm:
+    if(Profile) ++counts[ip - &ops[0] + 2];
+    if(Count) ++instructions;
+    regs[ip->t] = ip->imm;
+    regs[ip->d] = regs[ip->s] + ip->imm;
+    ip += 3;
+    DISPATCH();
+
+opSubImm:
+    if(Profile) ++counts[ip - &ops[0] + 2];
+    if(Count) ++instructions;
+    regs[ip->t] = ip->imm;
+    regs[ip->d] = regs[ip->s] - ip->imm;
+    ip += 3;
+    DISPATCH();
+
+opJrImm:
+    if(Profile) ++counts[ip - &ops[0] + 2];
+    if(Count) ++instructions;
+    target = regs[ip->d] = ip->imm;
+    goto jump;
+
+opJalrImm:
+    if(Profile) ++counts[ip - &ops[0] + 2];
+    if(Count) ++instructions;
+    target = regs[ip->d] = ip->imm;
+    regs[31] = static_cast<int32_t>((ip - &ops[0] + 3) * isize);
+    goto jump;
+
+jump:
+    if(target == exitAddress) {
+        console.flush();
+        if(Count) *retired += instructions;
+        return false;
+    }
+
+    if(static_cast<uint32_t>(target) >= codeSize || target % isize != 0) {
+        throw std::runtime_error{"Jumped to invalid code address: " + std::to_string(target)};
+    }
+
+    ip = &ops[target / isize];
+    DISPATCH();
+
+opInvalid:
+    throw std::runtime_error{"Invalid instruction at address " + std::to_string((ip - &ops[0]) * isize)};
+
+opOutOfCode:
+    throw std::runtime_error{"Execution ran past the end of the code segment"};
+
+    #undef DISPATCH
 }
+
+// A single guest machine. It owns its memory, registers and console, so any
+// number of them can run at once on different threads.
+struct VM
+{
+    // If mips is set the image is MIPS32 words (see decoder.cc)
+    VM(const Instruction* code, size_t codeSize, FILE* in, FILE* out, size_t memSize = defaultMemSize, bool mips = false) :
+        mem{memSize}, console{in, out}, codeSize{codeSize}, mips{mips}
+    {
+        loadImage(code, codeSize, mem, cpu);
+    }
+
+    // Resumes the machine saved in a snapshot file (see snapshot.cc)
+    VM(const std::string& snapshotPath, FILE* in, FILE* out);
+
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
+    // Where to write a snapshot when the guest stores to checkpointAddress.
+    // Checkpoints are ignored if this is empty.
+    void setSnapshotPath(std::string path) { snapshotPath = std::move(path); }
+
+    // Runs the program to completion in the interpreter, collecting
+    // execution counts into profile if it's given, or just adding up the
+    // instructions retired in retired
+    void run(ExecProfile* profile = nullptr, uint64_t* retired = nullptr)
+    {
+        while(profile ? interpret<true, false>(mem, cpu, console, codeSize, mips, profile, nullptr) :
+              retired ? interpret<false, true>(mem, cpu, console, codeSize, mips, nullptr, retired) :
+                        interpret<false, false>(mem, cpu, console, codeSize, mips, nullptr, nullptr)) {
+            checkpoint();
+        }
+    }
+
+    // Runs the program to completion with the JIT (see jit.cc)
+    void runJit();
+
+private:
+    Memory mem;
+    Cpu cpu;
+    Console console;
+
+    size_t codeSize;
+    bool mips;
+
+    std::string snapshotPath;
+
+    void checkpoint()
+    {
+        if(!snapshotPath.empty()) {
+            saveSnapshot(snapshotPath);
+        }
+    }
+
+    // See snapshot.cc
+    static size_t readSnapshotMemSize(const std::string& path);
+    void saveSnapshot(const std::string& path);
+    void restoreSnapshot(const std::string& path);
+};
@@ -0,0 +1,144 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Moves work which comes out the same on every trip around a loop (constants,
+// frame addresses and arithmetic on registers the loop doesn't change) to
+// just before the loop, before register allocation. Only virtual registers
+// written once in the whole function are moved, so nothing else can see the
+// value change; anything read before it's written in the loop stays put.
+struct Hoister
+{
+    // The label at the top of a loop's body (which only the loop's own test
+    // branches back to) and the one just past the loop
+    struct Loop
+    {
+        std::string top, end;
+    };
+
+    // Loops must come innermost first, so what's moved out of an inner loop
+    // can be moved out of the outer one as well
+    void run(Codegen& body, const std::vector<Loop>& loops)
+    {
+        auto code = body.getCode();
+
+        for(auto& loop : loops) {
+            hoist(code, loop);
+        }
+
+        body.setCode(std::move(code));
+    }
+
+private:
+    typedef Codegen::Op Op;
+
+    // Instructions whose result depends only on their operands
+    static bool isPure(Instruction::Type type)
+    {
+        switch(type) {
+            case Instruction::LIS: case Instruction::ADD: case Instruction::SUB: case Instruction::SLT:
+            case Instruction::AND: case Instruction::OR: case Instruction::XOR:
+            case Instruction::SLLV: case Instruction::SRAV: return true;
+
+            default: return Codegen::isImmAlu(type);
+        }
+    }
+
+    static size_t find(const std::vector<Op>& code, const std::string& label)
+    {
+        for(size_t i = 0; i < code.size(); ++i) {
+            if(code[i].kind == Op::LABEL && code[i].label == label) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error{"Loop label " + label + " went missing"};
+    }
+
+    // The register op writes, if it's one we know about
+    static int getWritten(const Op& op)
+    {
+        switch(op.kind) {
+            case Op::INSTR: return Codegen::getWritten(op);
+            case Op::ARG: case Op::FRAME: return op.d;
+            default: return -1;
+        }
+    }
+
+    void hoist(std::vector<Op>& code, const Loop& loop)
+    {
+        auto top = find(code, loop.top);
+        auto end = find(code, loop.end);
+
+        std::unordered_map<int, int> writes, writesInLoop;
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            auto written = getWritten(code[i]);
+
+            if(written >= 0) {
+                writes[written] += 1;
+
+                if(i > top && i < end) {
+                    writesInLoop[written] += 1;
+                }
+            }
+        }
+
+        // Calls and asm can change real registers, so only $0 is known to stay put
+        auto invariant = [&](int r) {
+            return r == 0 || (r >= FIRST_VREG && !writesInLoop[r]);
+        };
+
+        std::vector<bool> moved(code.size(), false);
+        std::unordered_map<int, bool> read;
+
+        for(size_t i = top + 1; i < end; ++i) {
+            auto& op = code[i];
+
+            auto written = getWritten(op);
+
+            bool hasWord = op.kind == Op::INSTR && op.type == Instruction::LIS && i + 1 < end &&
+                           code[i + 1].kind == Op::WORD;
+
+            bool pure = op.kind == Op::FRAME || (op.kind == Op::INSTR && isPure(op.type) &&
+                        (op.type != Instruction::LIS || hasWord));
+
+            if(pure && written >= FIRST_VREG && writes[written] == 1 && !read[written] &&
+               (op.kind != Op::INSTR || ((!Codegen::readsS(op.type) || invariant(op.s)) &&
+                                         (!Codegen::readsT(op.type) || invariant(op.t))))) {
+                moved[i] = true;
+                writesInLoop[written] = 0;
+
+                if(hasWord) {
+                    moved[++i] = true;
+                }
+
+                continue;
+            }
+
+            if(op.kind == Op::INSTR) {
+                if(Codegen::readsS(op.type)) read[op.s] = true;
+                if(Codegen::readsT(op.type)) read[op.t] = true;
+            }
+        }
+
+        std::vector<Op> result;
+        result.reserve(code.size());
+
+        result.insert(result.end(), code.begin(), code.begin() + top);
+
+        for(size_t i = top; i < end; ++i) {
+            if(moved[i]) {
+                result.push_back(code[i]);
+            }
+        }
+
+        for(size_t i = top; i < code.size(); ++i) {
+            if(!moved[i]) {
+                result.push_back(code[i]);
+            }
+        }
+
+        code = std::move(result);
+    }
+};
@@ -0,0 +1,249 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+// Replaces calls to small leaf functions with a copy of their body, before
+// register allocation. The callee's virtual registers are renumbered past the
+// caller's, the labels it defines (including those in inline asm) get a prefix
+// unique to the call, and each return becomes a jump past the copy. A leaf
+// can't be recursive, and since callees are inlined into first, a function
+// whose only calls were inlined can be inlined in turn.
+struct Inliner
+{
+    // Bodies bigger than this many words are left as calls
+    static const int SIZE_LIMIT = 20;
+
+    explicit Inliner(const std::unordered_map<std::string, Codegen>& bodies) : bodies{bodies} {}
+
+    // Functions with asm keep their locals in real registers, which the
+    // callee's code could overwrite, so they aren't inlined into
+    Codegen run(const std::string& funcName, const Codegen& body)
+    {
+        auto code = body.getCode();
+
+        // Offsets in branches would go stale once calls grow into bodies
+        Codegen::labelBranches(code, funcName);
+
+        std::vector<Op> result;
+
+        int nextReg = FIRST_VREG;
+
+        for(auto& op : code) {
+            nextReg = std::max({nextReg, op.s + 1, op.t + 1, op.d + 1});
+        }
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            auto& op = code[i];
+
+            auto found = op.kind == Op::CALL ? bodies.find(op.label) : bodies.end();
+
+            if(found == bodies.end() || !canInline(found->second.getCode())) {
+                result.push_back(op);
+                continue;
+            }
+
+            auto callee = found->second.getCode();
+            auto prefix = funcName + "XXXXinline" + std::to_string(count++) + op.label;
+
+            Codegen::labelBranches(callee, prefix);
+
+            // Arguments the callee only reads are read straight from where the
+            // caller computed them, rather than copied into $1... first
+            auto argCount = static_cast<size_t>(op.imm);
+            std::vector<int> args(argCount, -1);
+
+            if(result.size() >= argCount) {
+                auto first = result.size() - argCount;
+
+                for(size_t a = 0; a < argCount; ++a) {
+                    auto& move = result[first + a];
+
+                    if(isInstr(move, Instruction::ADD) && move.t == 0 && move.d == static_cast<int>(a + 1) &&
+                       (move.s == 0 || move.s >= FIRST_VREG) && !writes(callee, move.d)) {
+                        args[a] = move.s;
+                    }
+                }
+
+                std::vector<Op> moves(result.begin() + first, result.end());
+
+                result.resize(first);
+
+                for(size_t a = 0; a < argCount; ++a) {
+                    if(args[a] < 0) {
+                        result.push_back(moves[a]);
+                    }
+                }
+            }
+
+            while(!callee.empty() && callee.back().kind == Op::RET) {
+                callee.pop_back();
+            }
+
+            // Likewise a value returned at the very end goes straight to the
+            // register the caller copies it into
+            int resultReg = -1;
+
+            if(!hasRet(callee) && !callee.empty() && isInstr(callee.back(), Instruction::ADD) &&
+               callee.back().d == RETVAL_REG && callee.back().t == 0 && i + 1 < code.size() &&
+               isInstr(code[i + 1], Instruction::ADD) && code[i + 1].s == RETVAL_REG && code[i + 1].t == 0) {
+                resultReg = code[i + 1].d;
+
+                // Skip the caller's copy
+                ++i;
+            }
+
+            std::unordered_set<std::string> defined;
+
+            for(auto& c : callee) {
+                if(c.kind == Op::LABEL) {
+                    defined.insert(c.label);
+                }
+            }
+
+            auto endLabel = prefix + "XXXXend";
+            int offset = nextReg - FIRST_VREG;
+
+            auto rename = [&](int& r) {
+                if(r >= FIRST_VREG) {
+                    r += offset;
+                } else if(r >= 1 && r <= static_cast<int>(argCount) && args[r - 1] >= 0) {
+                    r = args[r - 1];
+                }
+            };
+
+            for(size_t j = 0; j < callee.size(); ++j) {
+                auto c = callee[j];
+
+                if(c.kind == Op::RET) {
+                    result.push_back(Op{Op::INSTR, Instruction::BEQ, 0, 0, 0, 0, endLabel});
+                    continue;
+                }
+
+                if(!c.label.empty() && defined.count(c.label)) {
+                    c.label = prefix + c.label;
+                }
+
+                if(c.kind == Op::INSTR) {
+                    if(Codegen::readsS(c.type)) rename(c.s);
+                    if(Codegen::readsT(c.type)) rename(c.t);
+
+                    auto written = Codegen::getWritten(c);
+
+                    if(written >= FIRST_VREG) {
+                        (written == c.d ? c.d : c.t) += offset;
+                    }
+                }
+
+                if(resultReg >= 0 && j + 1 == callee.size()) {
+                    c.d = resultReg;
+                }
+
+                result.push_back(c);
+            }
+
+            result.push_back(Op{Op::LABEL, Instruction::LIS, 0, 0, 0, 0, endLabel});
+
+            for(size_t j = 0; j < callee.size(); ++j) {
+                auto& c = callee[j];
+                nextReg = std::max({nextReg, c.s + offset + 1, c.t + offset + 1, c.d + offset + 1});
+            }
+        }
+
+        Codegen gen;
+
+        gen.setCode(std::move(result));
+
+        return gen;
+    }
+
+private:
+    typedef Codegen::Op Op;
+
+    const std::unordered_map<std::string, Codegen>& bodies;
+
+    int count = 0;
+
+    static bool isInstr(const Op& op, Instruction::Type type)
+    {
+        return op.kind == Op::INSTR && op.type == type;
+    }
+
+    static bool hasRet(const std::vector<Op>& code)
+    {
+        for(auto& op : code) {
+            if(op.kind == Op::RET) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool writes(const std::vector<Op>& code, int reg)
+    {
+        for(auto& op : code) {
+            if(op.kind == Op::INSTR && Codegen::getWritten(op) == reg) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool touches(const Op& op, int reg)
+    {
+        return (Codegen::readsS(op.type) && op.s == reg) || (Codegen::readsT(op.type) && op.t == reg) ||
+               Codegen::getWritten(op) == reg;
+    }
+
+    // A leaf small enough, that keeps out of the stack and the registers
+    // the caller's frame and spills depend on
+    static bool canInline(const std::vector<Op>& code)
+    {
+        std::unordered_set<std::string> defined;
+
+        for(auto& op : code) {
+            if(op.kind == Op::LABEL) {
+                defined.insert(op.label);
+            }
+        }
+
+        int size = 0;
+
+        for(size_t i = 0; i < code.size(); ++i) {
+            auto& op = code[i];
+
+            switch(op.kind) {
+                case Op::LABEL: case Op::RET: break;
+
+                case Op::WORD: ++size; break;
+
+                case Op::INSTR: {
+                    ++size;
+
+                    for(int r : {SCRATCH_REG_A, SCRATCH_REG_B, SP_REG, LINK_REG}) {
+                        if(touches(op, r)) {
+                            return false;
+                        }
+                    }
+
+                    if(op.type == Instruction::JALR) {
+                        return false;
+                    }
+
+                    // Only lis $r; .word label; jr $r to one of its own labels
+                    if(op.type == Instruction::JR && (i < 2 || code[i - 2].kind != Op::INSTR ||
+                       code[i - 2].type != Instruction::LIS || code[i - 2].d != op.s ||
+                       code[i - 1].kind != Op::WORD || !defined.count(code[i - 1].label))) {
+                        return false;
+                    }
+                } break;
+
+                default: return false;
+            }
+        }
+
+        return size <= SIZE_LIMIT;
+    }
+};
@@ -0,0 +1,582 @@
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstddef>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define WAT_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#endif
+
+#ifdef WAT_JIT_SUPPORTED
+
+// Translates basic blocks of the internal ISA into x86-64.
+//
+// Inside translated code rbx holds the Cpu*, r12 the guest memory's page
+// table and r13 a table of block entry points indexed by guest word. Guest registers stay in
+// the Cpu struct. A block leaves through the epilogue with the next guest pc
+// in eax; bit 32 of rax is set when the instruction at that pc has to go
+// through step() first (MMIO, untouched pages, unaligned or out of range
+// accesses and stores into the code segment).
+struct Jit
+{
+    Jit(size_t codeSize, size_t memSize, bool mips) : codeSize{codeSize}, memSize{memSize}, mips{mips}, blocks(codeSize / sizeof(Instruction)), covered(codeSize / sizeof(Instruction))
+    {
+        buf = static_cast<uint8_t*>(mmap(nullptr, BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+        if(buf == MAP_FAILED) {
+            throw std::runtime_error{"Failed to allocate executable memory for the JIT"};
+        }
+
+        // Entry trampoline: (Cpu*, pages, blocks, block) -> next pc
+        emit8(0x53);                        // push rbx
+        emit8(0x41); emit8(0x54);           // push r12
+        emit8(0x41); emit8(0x55);           // push r13
+        emit8(0x48); emit8(0x89); emit8(0xfb);  // mov rbx, rdi
+        emit8(0x49); emit8(0x89); emit8(0xf4);  // mov r12, rsi
+        emit8(0x49); emit8(0x89); emit8(0xd5);  // mov r13, rdx
+        emit8(0xff); emit8(0xe1);           // jmp rcx
+
+        epilogue = used;
+
+        emit8(0x41); emit8(0x5d);           // pop r13
+        emit8(0x41); emit8(0x5c);           // pop r12
+        emit8(0x5b);                        // pop rbx
+        emit8(0xc3);                        // ret
+
+        firstBlock = used;
+    }
+
+    ~Jit()
+    {
+        munmap(buf, BUF_SIZE);
+    }
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    uint64_t enter(Cpu& cpu, Memory& mem, void* block)
+    {
+        using EntryFn = uint64_t (*)(Cpu*, uint8_t* const*, void**, void*);
+
+        return reinterpret_cast<EntryFn>(buf)(&cpu, mem.getPageTable(), &blocks[0], block);
+    }
+
+    // Returns the translated block starting at pc, translating it if needed.
+    // Returns nullptr if the instruction at pc can't be translated.
+    void* getBlock(int32_t pc, Memory& mem)
+    {
+        auto index = pc / sizeof(Instruction);
+
+        if(!blocks[index]) {
+            if(BUF_SIZE - used < MAX_BLOCK_BYTES) {
+                flush();
+            }
+
+            translate(pc, mem);
+        }
+
+        return blocks[index];
+    }
+
+    // Whether any translated block was built from the given memory
+    bool covers(MemRange range) const
+    {
+        auto first = static_cast<uint32_t>(range.addr) / sizeof(Instruction);
+        auto last = (static_cast<uint64_t>(static_cast<uint32_t>(range.addr)) + range.size - 1) / sizeof(Instruction);
+
+        for(auto i = first; i <= last && i < covered.size(); ++i) {
+            if(covered[i]) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Throws away every translated block. Must not be called while inside one.
+    void flush()
+    {
+        used = firstBlock;
+
+        std::fill(blocks.begin(), blocks.end(), nullptr);
+        std::fill(covered.begin(), covered.end(), 0);
+
+        pendingExits.clear();
+    }
+
+private:
+    static const size_t BUF_SIZE = 16 << 20;
+    static const int MAX_BLOCK_INSTRS = 256;
+    static const size_t MAX_BLOCK_BYTES = MAX_BLOCK_INSTRS * 128;
+
+    // The most one instruction can add to a block, counting the stubs it
+    // leaves for the end: a store is about 75 bytes inline plus four stubs
+    static const size_t STUB_BYTES = 15;
+    static const size_t MAX_INSTR_BYTES = 160;
+
+    // mov eax, pc; jmp rel32
+    static const size_t EXIT_BYTES = 10;
+
+    // Register numbers as encoded in ModRM
+    enum { EAX = 0, ECX = 1, EDX = 2 };
+
+    size_t codeSize;
+    size_t memSize;
+    bool mips;      // The image is MIPS32 (see decoder.cc)
+
+    uint8_t* buf;
+    size_t used = 0;
+    size_t epilogue = 0;
+    size_t firstBlock = 0;
+
+    std::vector<void*> blocks;
+    std::vector<uint8_t> covered;
+
+    // Positions of rel32 jumps to the epilogue that should be pointed at the
+    // block for the given pc once it's translated
+    std::unordered_map<int32_t, std::vector<size_t>> pendingExits;
+
+    // Positions of rel32 jumps to out-of-line stubs which hand pc to step()
+    std::vector<std::pair<size_t, int32_t>> stepStubs;
+
+    void emit8(uint8_t b) { buf[used++] = b; }
+
+    void emit32(int32_t v)
+    {
+        memcpy(&buf[used], &v, sizeof(v));
+        used += sizeof(v);
+    }
+
+    void patchRel32(size_t pos, size_t target)
+    {
+        int32_t rel = static_cast<int32_t>(target - (pos + 4));
+        memcpy(&buf[pos], &rel, sizeof(rel));
+    }
+
+    static int32_t regOffset(int reg) { return static_cast<int32_t>(offsetof(Cpu, regs) + reg * sizeof(int32_t)); }
+
+    // op r32, [rbx + disp32]
+    void emitRbxOp(uint8_t opcode, int reg, int32_t disp)
+    {
+        emit8(opcode);
+        emit8(0x80 | (reg << 3) | 3);
+        emit32(disp);
+    }
+
+    void loadReg(int hostReg, int guestReg) { emitRbxOp(0x8b, hostReg, regOffset(guestReg)); }
+
+    void storeReg(int guestReg, int hostReg)
+    {
+        emitRbxOp(0x89, hostReg, regOffset(guestReg ? guestReg : SINK_REG));
+    }
+
+    // jcc rel32 (or jmp when cc is 0), returns the position of the displacement
+    size_t emitJump(uint8_t cc)
+    {
+        if(cc) {
+            emit8(0x0f);
+            emit8(cc);
+        } else {
+            emit8(0xe9);
+        }
+
+        emit32(0);
+
+        return used - 4;
+    }
+
+    // Leaves the block for a statically known pc, chaining straight into its
+    // block when there is one
+    void emitExit(int32_t pc)
+    {
+        emit8(0xb8);        // mov eax, pc
+        emit32(pc);
+
+        auto pos = emitJump(0);
+
+        auto index = static_cast<uint32_t>(pc) / sizeof(Instruction);
+
+        if(static_cast<uint32_t>(pc) < codeSize && pc % sizeof(Instruction) == 0 && blocks[index]) {
+            patchRel32(pos, static_cast<uint8_t*>(blocks[index]) - buf);
+        } else {
+            patchRel32(pos, epilogue);
+            pendingExits[pc].push_back(pos);
+        }
+    }
+
+    // Jumps to the block whose guest address is in eax, or returns it to the
+    // dispatcher if it hasn't been translated
+    void emitIndirectExit()
+    {
+        emit8(0x3d);        // cmp eax, codeSize
+        emit32(static_cast<int32_t>(codeSize));
+        patchRel32(emitJump(0x83), epilogue);      // jae
+
+        emit8(0xa8); emit8(0x03);       // test al, 3
+        patchRel32(emitJump(0x85), epilogue);      // jnz
+
+        emit8(0x49); emit8(0x8b); emit8(0x4c); emit8(0x45); emit8(0x00);   // mov rcx, [r13 + rax * 2]
+        emit8(0x48); emit8(0x85); emit8(0xc9);     // test rcx, rcx
+        patchRel32(emitJump(0x84), epilogue);      // jz
+
+        emit8(0xff); emit8(0xe1);       // jmp rcx
+    }
+
+    // Leaves rdx + rax pointing at the host address of regs[s] + imm, bailing
+    // out to step() unless it's an access to a touched page (aligned, if it's
+    // a word, and for stores, outside the code segment)
+    void emitAddress(int32_t pc, int s, int16_t imm, bool store, bool word)
+    {
+        loadReg(EAX, s);
+
+        emit8(0x05);        // add eax, imm
+        emit32(imm);
+
+        emit8(0x3d);        // cmp eax, memSize
+        emit32(static_cast<int32_t>(memSize));
+        stepStubs.emplace_back(emitJump(0x83), pc);    // jae
+
+        if(word) {
+            emit8(0xa8); emit8(0x03);   // test al, 3
+            stepStubs.emplace_back(emitJump(0x85), pc);    // jnz
+        }
+
+        if(store) {
+            emit8(0x3d);    // cmp eax, codeSize
+            emit32(static_cast<int32_t>(codeSize));
+            stepStubs.emplace_back(emitJump(0x82), pc);    // jb
+        }
+
+        emit8(0x89); emit8(0xc2);                       // mov edx, eax
+        emit8(0xc1); emit8(0xea); emit8(Memory::PAGE_BITS);    // shr edx, PAGE_BITS
+        emit8(0x49); emit8(0x8b); emit8(0x14); emit8(0xd4);    // mov rdx, [r12 + rdx * 8]
+        emit8(0x48); emit8(0x85); emit8(0xd2);          // test rdx, rdx
+        stepStubs.emplace_back(emitJump(0x84), pc);    // jz
+
+        emit8(0x25);        // and eax, PAGE_MASK
+        emit32(Memory::PAGE_MASK);
+    }
+
+    // Moves the byte emitAddress left in rdx + rax to where the guest
+    // expects it (see byteSwap() in emulator.cc); it stays in the same word
+    void emitByteSwap()
+    {
+        if(mips) {
+            emit8(0x83); emit8(0xf0); emit8(0x03);  // xor eax, 3
+        }
+    }
+
+    void translate(int32_t startPc, Memory& mem)
+    {
+        const int32_t isize = sizeof(Instruction);
+
+        auto start = used;
+        auto pc = startPc;
+
+        stepStubs.clear();
+
+        for(int count = 0; ; ++count) {
+            // Stop while the next instruction, its stubs and the exit after
+            // it are sure to fit in the room getBlock made
+            auto size = used - start + stepStubs.size() * STUB_BYTES;
+
+            if(count == MAX_BLOCK_INSTRS || static_cast<uint32_t>(pc) + isize > codeSize ||
+               size + MAX_INSTR_BYTES + EXIT_BYTES > MAX_BLOCK_BYTES) {
+                emitExit(pc);
+                break;
+            }
+
+            auto instr = fetch(mem, pc, mips);
+
+            auto s = instr.getS();
+            auto t = instr.getT();
+            auto d = instr.getD();
+            auto imm = instr.getImm();
+
+            auto type = instr.getType();
+
+            if(type > Instruction::SB || (type == Instruction::LIS && static_cast<uint32_t>(pc) + 2 * isize > codeSize)) {
+                // Let step() deal with it
+                if(count == 0) {
+                    used = start;
+                    return;
+                }
+
+                emitExit(pc);
+                break;
+            }
+
+            covered[pc / isize] = 1;
+
+            bool ended = false;
+
+            switch(type) {
+                case Instruction::LIS: {
+                    covered[pc / isize + 1] = 1;
+
+                    emitRbxOp(0xc7, 0, regOffset(d ? d : SINK_REG));   // mov dword [reg], imm
+                    emit32(mem.load(pc + isize));
+
+                    pc += isize;
+                } break;
+
+                case Instruction::ADD: case Instruction::SUB: {
+                    loadReg(EAX, s);
+                    emitRbxOp(type == Instruction::ADD ? 0x03 : 0x2b, EAX, regOffset(t));
+                    storeReg(d, EAX);
+                } break;
+
+                case Instruction::SLT: {
+                    loadReg(EAX, s);
+                    emitRbxOp(0x3b, EAX, regOffset(t));         // cmp eax, [t]
+                    emit8(0x0f); emit8(0x9c); emit8(0xc0);      // setl al
+                    emit8(0x0f); emit8(0xb6); emit8(0xc0);      // movzx eax, al
+                    storeReg(d, EAX);
+                } break;
+
+                case Instruction::MULT: case Instruction::DIV: {
+                    loadReg(EAX, s);
+
+                    if(type == Instruction::MULT) {
+                        emitRbxOp(0xf7, 5, regOffset(t));       // imul dword [t]
+                    } else {
+                        emit8(0x99);                            // cdq
+                        emitRbxOp(0xf7, 7, regOffset(t));       // idiv dword [t]
+                    }
+
+                    emitRbxOp(0x89, EAX, offsetof(Cpu, lo));
+                    emitRbxOp(0x89, EDX, offsetof(Cpu, hi));
+                } break;
+
+                case Instruction::MFHI: case Instruction::MFLO: {
+                    emitRbxOp(0x8b, EAX, type == Instruction::MFHI ? offsetof(Cpu, hi) : offsetof(Cpu, lo));
+                    storeReg(d, EAX);
+                } break;
+
+                case Instruction::LW: {
+                    emitAddress(pc, s, imm, false, true);
+
+                    emit8(0x8b); emit8(0x0c); emit8(0x02);     // mov ecx, [rdx + rax]
+                    storeReg(t, ECX);
+                } break;
+
+                case Instruction::SW: {
+                    emitAddress(pc, s, imm, true, true);
+
+                    loadReg(ECX, t);
+                    emit8(0x89); emit8(0x0c); emit8(0x02);     // mov [rdx + rax], ecx
+                } break;
+
+                case Instruction::LB: {
+                    emitAddress(pc, s, imm, false, false);
+                    emitByteSwap();
+
+                    emit8(0x0f); emit8(0xbe); emit8(0x0c); emit8(0x02);   // movsx ecx, byte [rdx + rax]
+                    storeReg(t, ECX);
+                } break;
+
+                case Instruction::SB: {
+                    emitAddress(pc, s, imm, true, false);
+                    emitByteSwap();
+
+                    loadReg(ECX, t);
+                    emit8(0x88); emit8(0x0c); emit8(0x02);     // mov [rdx + rax], cl
+                } break;
+
+                case Instruction::BEQ: case Instruction::BNE: {
+                    loadReg(EAX, s);
+                    emitRbxOp(0x3b, EAX, regOffset(t));
+
+                    // Skip the taken exit when the branch isn't taken
+                    auto notTaken = emitJump(type == Instruction::BEQ ? 0x85 : 0x84);
+
+                    emitExit(pc + isize + imm * isize);
+
+                    patchRel32(notTaken, used);
+                    emitExit(pc + isize);
+
+                    ended = true;
+                } break;
+
+                case Instruction::BLTZ: case Instruction::BGEZ: case Instruction::BLEZ: case Instruction::BGTZ: {
+                    emitRbxOp(0x83, 7, regOffset(s));           // cmp dword [s], 0
+                    emit8(0);
+
+                    // jge, jl, jg or jle past the taken exit
+                    static const uint8_t notTakenCc[] = {0x8d, 0x8c, 0x8f, 0x8e};
+
+                    auto notTaken = emitJump(notTakenCc[type - Instruction::BLTZ]);
+
+                    emitExit(pc + isize + imm * isize);
+
+                    patchRel32(notTaken, used);
+                    emitExit(pc + isize);
+
+                    ended = true;
+                } break;
+
+                case Instruction::ADDI: case Instruction::ORI: {
+                    loadReg(EAX, s);
+
+                    if(type == Instruction::ADDI) {
+                        emit8(0x05);                            // add eax, imm
+                        emit32(imm);
+                    } else {
+                        emit8(0x0d);                            // or eax, imm
+                        emit32(static_cast<uint16_t>(imm));
+                    }
+
+                    storeReg(t, EAX);
+                } break;
+
+                case Instruction::SLTI: {
+                    loadReg(EAX, s);
+                    emit8(0x3d);                                // cmp eax, imm
+                    emit32(imm);
+                    emit8(0x0f); emit8(0x9c); emit8(0xc0);      // setl al
+                    emit8(0x0f); emit8(0xb6); emit8(0xc0);      // movzx eax, al
+                    storeReg(t, EAX);
+                } break;
+
+                case Instruction::AND: case Instruction::OR: case Instruction::XOR: {
+                    static const uint8_t opcodes[] = {0x23, 0x0b, 0x33};    // and, or, xor eax, [t]
+
+                    loadReg(EAX, s);
+                    emitRbxOp(opcodes[type - Instruction::AND], EAX, regOffset(t));
+                    storeReg(d, EAX);
+                } break;
+
+                case Instruction::SLLV: case Instruction::SRAV: {
+                    loadReg(ECX, t);
+                    loadReg(EAX, s);
+                    emit8(0xd3); emit8(type == Instruction::SLLV ? 0xe0 : 0xf8);   // shl/sar eax, cl
+                    storeReg(d, EAX);
+                } break;
+
+                case Instruction::ANDI: {
+                    loadReg(EAX, s);
+                    emit8(0x25);                                // and eax, imm
+                    emit32(static_cast<uint16_t>(imm));
+                    storeReg(t, EAX);
+                } break;
+
+                case Instruction::SLL: case Instruction::SRA: case Instruction::SRL: {
+                    static const uint8_t modrms[] = {0xe0, 0xf8, 0xe8};     // shl, sar, shr eax
+
+                    loadReg(EAX, s);
+                    emit8(0xc1); emit8(modrms[type - Instruction::SLL]); emit8(imm & 31);
+                    storeReg(t, EAX);
+                } break;
+
+                case Instruction::LUI: {
+                    emitRbxOp(0xc7, 0, regOffset(t ? t : SINK_REG));   // mov dword [t], imm << 16
+                    emit32(static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(imm)) << 16));
+                } break;
+
+                case Instruction::JR: {
+                    loadReg(EAX, s);
+                    emitIndirectExit();
+
+                    ended = true;
+                } break;
+
+                case Instruction::JALR: {
+                    loadReg(EAX, s);
+
+                    emitRbxOp(0xc7, 0, regOffset(31));     // mov dword [$31], pc + 4
+                    emit32(pc + isize);
+
+                    emitIndirectExit();
+
+                    ended = true;
+                } break;
+
+                default: break;
+            }
+
+            if(ended) {
+                break;
+            }
+
+            pc += isize;
+        }
+
+        for(auto& stub : stepStubs) {
+            patchRel32(stub.first, used);
+
+            emit8(0x48); emit8(0xb8);       // mov rax, (1 << 32) | pc
+            emit32(stub.second);
+            emit32(1);
+
+            patchRel32(emitJump(0), epilogue);
+        }
+
+        blocks[startPc / isize] = &buf[start];
+
+        // Chain blocks that were waiting on this one
+        auto pending = pendingExits.find(startPc);
+
+        if(pending != pendingExits.end()) {
+            for(auto pos : pending->second) {
+                patchRel32(pos, start);
+            }
+
+            pendingExits.erase(pending);
+        }
+    }
+};
+
+#endif
+
+// Runs the image with basic blocks translated to native code, using step()
+// for the instructions the translated code bails out on
+void VM::runJit()
+{
+#ifdef WAT_JIT_SUPPORTED
+    const int32_t isize = sizeof(Instruction);
+
+    Jit jit{codeSize, mem.getSize(), mips};
+
+    // Steps the instruction at cpu.pc, throwing away translations it overwrites
+    auto stepAndInvalidate = [&]() {
+        auto result = step(cpu, mem, console, mips);
+
+        if(result.stored.size > 0 && jit.covers(result.stored)) {
+            jit.flush();
+        }
+
+        if(result.checkpoint) {
+            checkpoint();
+        }
+    };
+
+    while(true) {
+        if(cpu.pc == exitAddress) {
+            console.flush();
+            return;
+        }
+
+        if(static_cast<uint32_t>(cpu.pc) >= codeSize || cpu.pc % isize != 0) {
+            throw std::runtime_error{"Jumped to invalid code address: " + std::to_string(cpu.pc)};
+        }
+
+        auto block = jit.getBlock(cpu.pc, mem);
+
+        if(!block) {
+            stepAndInvalidate();
+            continue;
+        }
+
+        auto result = jit.enter(cpu, mem, block);
+
+        cpu.pc = static_cast<int32_t>(result);
+
+        if(result >> 32) {
+            stepAndInvalidate();
+        }
+    }
+#else
+    throw std::runtime_error{"The JIT is only available on x86-64 POSIX hosts"};
+#endif
+}
@@ -26,7 +26,9 @@ enum Token
     TOK_FALSE = -21,
     TOK_LOGICAL_AND = -22,
     TOK_LOGICAL_OR = -23,
-    TOK_EOF = -24
+    TOK_EOF = -24,
+    TOK_SHL = -25,
+    TOK_SHR = -26
 };
 
 struct Lexer
@@ -158,6 +160,16 @@ struct Lexer
             return TOK_GTE;
         }
 
+        if(lastCh == '<' && last == '<') {
+            last = s.get();
+            return TOK_SHL;
+        }
+
+        if(lastCh == '>' && last == '>') {
+            last = s.get();
+            return TOK_SHR;
+        }
+
         if(lastCh == '|' && last == '|') {
             last = s.get();
             return TOK_LOGICAL_OR;
@@ -1,50 +1,388 @@
 #include <iostream>
+#include <iterator>
 
 #include "error.cc"
+#include "memory.cc"
+#include "console.cc"
 #include "emulator.cc"
+#include "decoder.cc"
+#include "jit.cc"
+#include "snapshot.cc"
+#include "batch.cc"
 #include "codegen.cc"
+#include "regalloc.cc"
+#include "inliner.cc"
+#include "hoister.cc"
 #include "lexer.cc"
 #include "symbol.cc"
 #include "ast.cc"
 #include "typer.cc"
 #include "parser.cc"
+#include "optimizer.cc"
 #include "compiler.cc"
+#include "peephole.cc"
+#include "profiler.cc"
+
+// Parses a byte count like 65536, 512K, 64M or 1G
+size_t parseSize(const std::string& str)
+{
+    size_t end = 0;
+    unsigned long long value;
+
+    try {
+        value = std::stoull(str, &end, 0);
+    } catch(...) {
+        throw std::runtime_error{"Invalid size: " + str};
+    }
+
+    auto suffix = str.substr(end);
+
+    if(suffix == "K" || suffix == "k") value <<= 10;
+    else if(suffix == "M" || suffix == "m") value <<= 20;
+    else if(suffix == "G" || suffix == "g") value <<= 30;
+    else if(!suffix.empty()) throw std::runtime_error{"Invalid size: " + str};
+
+    return static_cast<size_t>(value);
+}
+
+// A compiled program, along with the symbols and labels that describe its image
+struct Program
+{
+    SymbolTable table;
+    Codegen gen;
+    Peephole peephole;
+    std::vector<Instruction> code;
+    bool mips = false;          // code is MIPS32 words (see decoder.cc)
+};
+
+std::unique_ptr<Program> compileProgram(const std::string& filename)
+{
+    auto program = std::make_unique<Program>();
+
+    std::ifstream file{filename};
+
+    if(!file) {
+        throw std::runtime_error{"Failed to open " + filename};
+    }
+
+    Parser parser;
+
+    parser.includes.insert(filename);
+
+    auto asts = parser.parseUntilEof(program->table, file);
+
+    Typer typer;
+
+    for(auto& a : asts) {
+        typer.checkTypes(program->table, *a);
+    }
+
+    Optimizer optimizer;
+
+    for(auto& a : asts) {
+        optimizer.optimize(program->table, a);
+    }
+
+    Compiler compiler;
+
+    compiler.compile(program->table, asts, program->gen);
+
+    program->peephole.run(program->gen);
+
+    program->code = program->gen.getPatchedCode();
+
+    return program;
+}
+
+// Reads a MIPS32 binary. The result has no symbols or labels.
+std::unique_ptr<Program> loadMips(const std::string& filename)
+{
+    std::ifstream file{filename, std::ios::binary};
+
+    if(!file) {
+        throw std::runtime_error{"Failed to open " + filename};
+    }
+
+    std::vector<uint8_t> bytes{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+    auto program = std::make_unique<Program>();
+
+    program->code = readMips(bytes.data(), bytes.size());
+    program->mips = true;
+
+    if(program->code.empty()) {
+        throw std::runtime_error{filename + " is empty"};
+    }
+
+    return program;
+}
+
+std::unique_ptr<Program> loadProgram(const std::string& filename, bool mips)
+{
+    return mips ? loadMips(filename) : compileProgram(filename);
+}
+
+// Runs every job listed in the file at path. Each line is
+//
+//     program.wat input output
+//
+// where input may be - for no input. Every program is compiled (or decoded,
+// with mips) once no matter how many jobs use it. Returns false if any job failed.
+bool runJobs(const char* path, unsigned threads, size_t memSize, bool jit, bool mips)
+{
+    std::ifstream file{path};
+
+    if(!file) {
+        throw std::runtime_error{std::string{"Failed to open job list "} + path};
+    }
+
+    std::unordered_map<std::string, std::unique_ptr<Program>> programs;
+    std::vector<BatchJob> jobs;
+
+    std::string line;
+    int lineNumber = 0;
+
+    while(std::getline(file, line)) {
+        ++lineNumber;
+
+        std::istringstream s{line};
+
+        std::string programPath, inputPath, outputPath;
+
+        if(!(s >> programPath) || programPath[0] == '#') {
+            continue;
+        }
+
+        if(!(s >> inputPath >> outputPath)) {
+            throw PosError{{lineNumber, path}, "Expected 'program input output'"};
+        }
+
+        auto& program = programs[programPath];
+
+        if(!program) {
+            program = loadProgram(programPath, mips);
+        }
+
+        jobs.push_back(BatchJob{&program->code, program->mips, inputPath == "-" ? "" : inputPath, outputPath});
+    }
+
+    WorkStealingPool pool{threads};
+
+    auto results = runBatch(jobs, pool, memSize, jit);
+
+    bool ok = true;
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        if(!results[i].ok) {
+            std::cerr << jobs[i].outputPath << ": " << results[i].error << "\n";
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// Runs one program over every input listed in the file at path. Each line is
+//
+//     input [output]
+//
+// where output defaults to the input path with .out on the end. Prints the
+// instructions (interpreter only) and wall time of each run to stdout as
+// tab-separated records. Returns false if any run failed.
+bool runInputs(const char* path, const Program& program, unsigned threads, size_t memSize, bool jit)
+{
+    std::ifstream file{path};
+
+    if(!file) {
+        throw std::runtime_error{std::string{"Failed to open input list "} + path};
+    }
+
+    std::vector<BatchJob> jobs;
+
+    std::string line;
+
+    while(std::getline(file, line)) {
+        std::istringstream s{line};
+
+        std::string inputPath, outputPath;
+
+        if(!(s >> inputPath) || inputPath[0] == '#') {
+            continue;
+        }
+
+        if(!(s >> outputPath)) {
+            outputPath = inputPath + ".out";
+        }
+
+        jobs.push_back(BatchJob{&program.code, program.mips, inputPath == "-" ? "" : inputPath, outputPath});
+    }
+
+    WorkStealingPool pool{threads};
+
+    auto results = runBatch(jobs, pool, memSize, jit, true);
+
+    std::cout << "output\tinstructions\tseconds\n";
+
+    bool ok = true;
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        if(!results[i].ok) {
+            std::cerr << jobs[i].outputPath << ": " << results[i].error << "\n";
+            ok = false;
+
+            continue;
+        }
+
+        std::cout << jobs[i].outputPath << '\t';
+
+        if(jit) {
+            std::cout << '-';
+        } else {
+            std::cout << results[i].instructions;
+        }
+
+        std::cout << '\t' << results[i].seconds << '\n';
+    }
+
+    return ok;
+}
+
+// Prints the profile report to stderr and writes the data file
+void writeProfile(const ExecProfile& profile, const Codegen& gen, SymbolTable& table, const char* path)
+{
+    Profiler profiler{profile, gen, table};
+
+    profiler.writeReport(std::cerr);
+
+    std::ofstream data{path};
+
+    if(!data) {
+        throw std::runtime_error{std::string{"Failed to open profile output file "} + path};
+    }
+
+    profiler.writeData(data);
+}
 
 int main(int argc, char** argv)
 {
     using namespace std;
 
     try {
-        if(argc != 2) {
-            std::cerr << "Usage: " << argv[0] << " [file.wat]\n";
-            return 1;
+        const char* filename = nullptr;
+        bool jit = false;
+        bool mips = false;
+        size_t memSize = defaultMemSize;
+        const char* profilePath = nullptr;
+        const char* jobsPath = nullptr;
+        const char* inputsPath = nullptr;
+        const char* snapshotPath = nullptr;
+        const char* restorePath = nullptr;
+        bool peepholeStats = false;
+        unsigned threads = std::thread::hardware_concurrency();
+
+        for(int i = 1; i < argc; ++i) {
+            if(strcmp(argv[i], "--jit") == 0) {
+                jit = true;
+            } else if(strcmp(argv[i], "--mips") == 0) {
+                mips = true;
+            } else if(strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+                memSize = parseSize(argv[++i]);
+            } else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+                profilePath = argv[++i];
+            } else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+                jobsPath = argv[++i];
+            } else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+                snapshotPath = argv[++i];
+            } else if(strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+                restorePath = argv[++i];
+            } else if(strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+                inputsPath = argv[++i];
+            } else if(strcmp(argv[i], "--peephole-stats") == 0) {
+                peepholeStats = true;
+            } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = static_cast<unsigned>(parseSize(argv[++i]));
+            } else if(!filename && argv[i][0] != '-') {
+                filename = argv[i];
+            } else {
+                filename = nullptr;
+                break;
+            }
+        }
+
+        if(jobsPath && !filename) {
+            return runJobs(jobsPath, threads, memSize, jit, mips) ? 0 : 1;
         }
 
-        std::ifstream file{argv[1]};
+        if(restorePath && !filename && !jobsPath && !profilePath) {
+            // The snapshot carries its own memory size
+            VM vm{restorePath, stdin, stdout};
 
-        SymbolTable table;
+            if(snapshotPath) {
+                vm.setSnapshotPath(snapshotPath);
+            }
 
-        Parser parser;
+            if(jit) {
+                vm.runJit();
+            } else {
+                vm.run();
+            }
 
-        parser.includes.insert(argv[1]);
+            return 0;
+        }
 
-        auto asts = parser.parseUntilEof(table, file);
+        if(!filename || jobsPath || restorePath || (inputsPath && (profilePath || snapshotPath))) {
+            std::cerr << "Usage: " << argv[0] << " [--jit] [--mem size] [--profile out.tsv] [--snapshot out.snap] [--peephole-stats] [file.wat | --mips file.mips]\n";
+            std::cerr << "       " << argv[0] << " [--jit] [--snapshot out.snap] --restore in.snap\n";
+            std::cerr << "       " << argv[0] << " [--jit] [--mem size] [--threads n] --inputs inputlist [file.wat | --mips file.mips]\n";
+            std::cerr << "       " << argv[0] << " [--jit] [--mips] [--mem size] [--threads n] --jobs joblist\n";
+            return 1;
+        }
 
-        Typer typer;
+        auto program = loadProgram(filename, mips);
 
-        for(auto& a : asts) {
-            typer.checkTypes(table, *a);
+        if(peepholeStats) {
+            for(int i = 0; i < Peephole::RULE_COUNT; ++i) {
+                cerr << Peephole::getRuleName(i) << '\t' << program->peephole.getRemoved(i) << '\n';
+            }
         }
 
-        Codegen gen;
+        if(inputsPath) {
+            return runInputs(inputsPath, *program, threads, memSize, jit) ? 0 : 1;
+        }
 
-        Compiler compiler;
+        auto& code = program->code;
 
-        compiler.compile(table, asts, gen);
+        VM vm{&code[0], code.size() * sizeof(Instruction), stdin, stdout, memSize, program->mips};
 
-        auto code = gen.getPatchedCode();
+        if(snapshotPath) {
+            vm.setSnapshotPath(snapshotPath);
+        }
+
+        if(profilePath) {
+            if(jit) {
+                throw std::runtime_error{"--profile counts instructions in the interpreter, so it can't be used with --jit"};
+            }
+
+            if(mips) {
+                throw std::runtime_error{"--profile needs the labels of a compiled program, so it can't be used with --mips"};
+            }
+
+            ExecProfile profile;
 
-        run(&code[0], code.size() * sizeof(Instruction));
+            try {
+                vm.run(&profile);
+            } catch(...) {
+                // Still report where the time went if the program dies
+                writeProfile(profile, program->gen, program->table, profilePath);
+                throw;
+            }
+
+            writeProfile(profile, program->gen, program->table, profilePath);
+        } else if(jit) {
+            vm.runJit();
+        } else {
+            vm.run();
+        }
     } catch(const PosError& e) {
         if(e.getPos().filename.empty()) {
             cerr << e.getPos().line << ": " << e.getMessage() << "\n";
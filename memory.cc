@@ -0,0 +1,179 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// The guest address space. It's split into pages which are only allocated
+// (zeroed) the first time something touches them, so a large address space
+// costs memory in proportion to what the program actually uses.
+struct Memory
+{
+    static const int PAGE_BITS = 12;
+    static const uint32_t PAGE_SIZE = 1 << PAGE_BITS;
+    static const uint32_t PAGE_MASK = PAGE_SIZE - 1;
+
+    // Addresses are signed words and the top 64 KiB is for devices, so this
+    // is as big as it gets
+    static const uint32_t MAX_SIZE = 0x7ffff000;
+
+    explicit Memory(size_t requestedSize)
+    {
+        if(requestedSize == 0 || requestedSize > MAX_SIZE) {
+            throw std::runtime_error{"Memory size must be between 1 and " + std::to_string(MAX_SIZE) + " bytes"};
+        }
+
+        size = static_cast<uint32_t>((requestedSize + PAGE_MASK) & ~static_cast<size_t>(PAGE_MASK));
+        pages.resize(size >> PAGE_BITS);
+    }
+
+    uint32_t getSize() const { return size; }
+
+    // Table of page pointers indexed by address >> PAGE_BITS (nullptr if the
+    // page hasn't been touched). The JIT reads it directly.
+    uint8_t* const* getPageTable() const { return &pages[0]; }
+
+    uint32_t getPageCount() const { return static_cast<uint32_t>(pages.size()); }
+
+    // Installs consecutive PAGE_SIZE chunks of region as the given pages (see
+    // snapshot.cc). The pages share ownership of region.
+    void mapPages(std::shared_ptr<uint8_t> region, const std::vector<uint32_t>& pageNumbers)
+    {
+        for(size_t i = 0; i < pageNumbers.size(); ++i) {
+            if(pageNumbers[i] >= pages.size()) {
+                throw std::runtime_error{"Page " + std::to_string(pageNumbers[i]) + " is out of bounds"};
+            }
+
+            pages[pageNumbers[i]] = region.get() + i * PAGE_SIZE;
+        }
+
+        mapped.push_back(std::move(region));
+    }
+
+    int32_t load(int32_t addr)
+    {
+        auto a = static_cast<uint32_t>(addr);
+
+        if(a < size && (a & 3) == 0) {
+            auto page = pages[a >> PAGE_BITS];
+
+            if(page) {
+                int32_t value;
+                memcpy(&value, &page[a & PAGE_MASK], sizeof(value));
+
+                return value;
+            }
+        }
+
+        return loadSlow(addr);
+    }
+
+    void store(int32_t addr, int32_t value)
+    {
+        auto a = static_cast<uint32_t>(addr);
+
+        if(a < size && (a & 3) == 0) {
+            auto page = pages[a >> PAGE_BITS];
+
+            if(page) {
+                memcpy(&page[a & PAGE_MASK], &value, sizeof(value));
+                return;
+            }
+        }
+
+        storeSlow(addr, value);
+    }
+
+    // Sign-extends the byte, like lb
+    int32_t loadByte(int32_t addr)
+    {
+        auto a = static_cast<uint32_t>(addr);
+
+        if(a < size) {
+            auto page = pages[a >> PAGE_BITS];
+
+            if(page) {
+                return static_cast<int8_t>(page[a & PAGE_MASK]);
+            }
+        }
+
+        checkRange(addr, 1);
+
+        return static_cast<int8_t>(byteAt(a));
+    }
+
+    void storeByte(int32_t addr, int32_t value)
+    {
+        checkRange(addr, 1);
+
+        byteAt(addr) = static_cast<uint8_t>(value);
+    }
+
+    // Copies len bytes from src into guest memory starting at addr
+    void write(int32_t addr, const void* src, size_t len)
+    {
+        checkRange(addr, len);
+
+        auto bytes = static_cast<const uint8_t*>(src);
+
+        for(size_t i = 0; i < len; ++i) {
+            byteAt(addr + i) = bytes[i];
+        }
+    }
+
+private:
+    uint32_t size;
+
+    std::vector<uint8_t*> pages;
+    std::vector<std::unique_ptr<uint8_t[]>> committed;
+    std::vector<std::shared_ptr<uint8_t>> mapped;
+
+    void checkRange(int32_t addr, size_t len) const
+    {
+        if(addr < 0 || static_cast<uint64_t>(addr) + len > size) {
+            throw std::runtime_error{"Memory access out of bounds at address " + std::to_string(addr)};
+        }
+    }
+
+    uint8_t& byteAt(uint32_t a)
+    {
+        auto& page = pages[a >> PAGE_BITS];
+
+        if(!page) {
+            committed.emplace_back(new uint8_t[PAGE_SIZE]());
+            page = committed.back().get();
+        }
+
+        return page[a & PAGE_MASK];
+    }
+
+    // Handles untouched pages and unaligned accesses (which may straddle pages)
+    int32_t loadSlow(int32_t addr)
+    {
+        checkRange(addr, sizeof(int32_t));
+
+        uint8_t bytes[sizeof(int32_t)];
+
+        for(uint32_t i = 0; i < sizeof(int32_t); ++i) {
+            bytes[i] = byteAt(addr + i);
+        }
+
+        int32_t value;
+        memcpy(&value, bytes, sizeof(value));
+
+        return value;
+    }
+
+    void storeSlow(int32_t addr, int32_t value)
+    {
+        checkRange(addr, sizeof(int32_t));
+
+        uint8_t bytes[sizeof(int32_t)];
+        memcpy(bytes, &value, sizeof(value));
+
+        for(uint32_t i = 0; i < sizeof(int32_t); ++i) {
+            byteAt(addr + i) = bytes[i];
+        }
+    }
+};
@@ -0,0 +1,502 @@
+#include <memory>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
+
+// Simplifies type checked ASTs before they're compiled. Operations on
+// constants are worked out here, as are operations on locals which are only
+// ever assigned a constant, and if/while branches which can't run are
+// dropped.
+//
+// A lone read of such a local is left alone: it costs nothing once the
+// register allocator is done with it, where the constant would need a lis.
+struct Optimizer
+{
+    void optimize(SymbolTable& table, std::unique_ptr<AST>& ast)
+    {
+        if(ast->getType() == AST::FUNC) {
+            auto& fst = static_cast<FuncAST&>(*ast);
+
+            foldStatement(fst.body);
+
+            auto func = table.getFunc(fst.getName());
+
+            // Inline asm can change locals behind our back
+            if(func && !containsAsm(*fst.body)) {
+                propagate(*func, fst.body);
+            }
+        } else if(ast->getType() == AST::BLOCK) {
+            // Included files
+            for(auto& a : static_cast<BlockAST&>(*ast).asts) {
+                optimize(table, a);
+            }
+        }
+    }
+
+private:
+    typedef std::unordered_map<std::string, std::pair<int32_t, AST::Type>> ConstMap;
+
+    // Locals known to hold a constant
+    ConstMap known;
+
+    // Set whenever something is folded
+    bool changed = false;
+
+    static bool isConst(const AST& ast)
+    {
+        return ast.getType() == AST::INT || ast.getType() == AST::BOOL || ast.getType() == AST::CHAR;
+    }
+
+    static int32_t getConst(const AST& ast)
+    {
+        return static_cast<int32_t>(static_cast<const IntAST&>(ast).getValue());
+    }
+
+    // Arithmetic wraps around like it does in the machine
+    static int32_t wrap(int64_t value)
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(value));
+    }
+
+    static std::unique_ptr<AST> makeConst(Pos pos, int64_t value, AST::Type type)
+    {
+        return std::unique_ptr<AST>{new IntAST{pos, value, type}};
+    }
+
+    // True if ast is a constant or a local known to hold one
+    bool getValue(const AST& ast, int32_t& value, AST::Type& type) const
+    {
+        if(isConst(ast)) {
+            value = getConst(ast);
+            type = ast.getType();
+
+            return true;
+        }
+
+        if(ast.getType() == AST::ID) {
+            auto found = known.find(static_cast<const IdAST&>(ast).getName());
+
+            if(found != known.end()) {
+                value = found->second.first;
+                type = found->second.second;
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void replace(std::unique_ptr<AST>& ast, int32_t value, AST::Type type)
+    {
+        ast = makeConst(ast->getPos(), value, type);
+        changed = true;
+    }
+
+    static std::unique_ptr<AST> makeEmpty(Pos pos)
+    {
+        return std::unique_ptr<AST>{new BlockAST{pos, {}}};
+    }
+
+    static bool containsAsm(const AST& ast)
+    {
+        switch(ast.getType()) {
+            case AST::ASM: return true;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    if(containsAsm(*a)) {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+                return containsAsm(ist.getBody()) || (ist.getAlt() && containsAsm(*ist.getAlt()));
+            }
+
+            case AST::WHILE: return containsAsm(static_cast<const WhileAST&>(ast).getBody());
+
+            default: return false;
+        }
+    }
+
+    // Works out op on two constants the same way the compiled code would.
+    // Returns false if it can't (division by zero is left to fail at runtime).
+    static bool evalBin(int op, int32_t a, int32_t b, int32_t& result, AST::Type& type)
+    {
+        switch(op) {
+            case '+': result = wrap(static_cast<int64_t>(a) + b); return true;
+            case '-': result = wrap(static_cast<int64_t>(a) - b); return true;
+            case '*': result = wrap(static_cast<int64_t>(a) * b); return true;
+
+            case '/': case '%': {
+                if(b == 0 || (a == INT_MIN && b == -1)) {
+                    return false;
+                }
+
+                result = op == '/' ? a / b : a % b;
+                return true;
+            }
+
+            case '&': result = a & b; return true;
+            case '|': result = a | b; return true;
+            case '^': result = a ^ b; return true;
+
+            // Shift amounts wrap at 32 like the instructions'
+            case TOK_SHL: result = static_cast<int32_t>(static_cast<uint32_t>(a) << (b & 31)); return true;
+            case TOK_SHR: result = a >> (b & 31); return true;
+        }
+
+        type = AST::BOOL;
+
+        switch(op) {
+            case TOK_EQUALS: result = a == b; return true;
+            case TOK_NOTEQUALS: result = a != b; return true;
+            case '<': result = a < b; return true;
+            case '>': result = a > b; return true;
+            case TOK_LTE: result = a <= b; return true;
+            case TOK_GTE: result = a >= b; return true;
+            case TOK_LOGICAL_AND: result = a != 0 && b != 0; return true;
+            case TOK_LOGICAL_OR: result = a != 0 || b != 0; return true;
+        }
+
+        return false;
+    }
+
+    void foldExpr(std::unique_ptr<AST>& ast)
+    {
+        switch(ast->getType()) {
+            case AST::PAREN: {
+                auto& inner = static_cast<ParenAST&>(*ast).inner;
+
+                foldExpr(inner);
+
+                if(isConst(*inner)) {
+                    ast = std::move(inner);
+                    changed = true;
+                }
+            } break;
+
+            case AST::CAST: {
+                auto& cst = static_cast<CastAST&>(*ast);
+
+                foldExpr(cst.value);
+
+                // Casts don't change the value, only its type, which has been checked already
+                if(isConst(*cst.value)) {
+                    auto type = AST::INT;
+
+                    switch(cst.getTargetType().tag) {
+                        case Typetag::BOOL: type = AST::BOOL; break;
+                        case Typetag::CHAR: type = AST::CHAR; break;
+                        default: break;
+                    }
+
+                    replace(ast, getConst(*cst.value), type);
+                }
+            } break;
+
+            case AST::UNARY: {
+                auto& ust = static_cast<UnaryAST&>(*ast);
+
+                foldExpr(ust.rhs);
+
+                int32_t value;
+                AST::Type type;
+
+                if(ust.getOp() == '-' && getValue(*ust.rhs, value, type)) {
+                    replace(ast, wrap(-static_cast<int64_t>(value)), type);
+                }
+            } break;
+
+            case AST::BIN: {
+                auto& bst = static_cast<BinAST&>(*ast);
+
+                foldExpr(bst.lhs);
+                foldExpr(bst.rhs);
+
+                int32_t a, b, result;
+                AST::Type type, rhsType;
+
+                if(getValue(*bst.lhs, a, type) && getValue(*bst.rhs, b, rhsType) &&
+                   evalBin(bst.getOp(), a, b, result, type)) {
+                    replace(ast, result, type);
+                }
+            } break;
+
+            case AST::CALL: {
+                for(auto& arg : static_cast<CallAST&>(*ast).args) {
+                    foldExpr(arg);
+                }
+            } break;
+
+            default: break;
+        }
+    }
+
+    void foldStatement(std::unique_ptr<AST>& ast)
+    {
+        switch(ast->getType()) {
+            case AST::BIN: {
+                auto& bst = static_cast<BinAST&>(*ast);
+
+                foldExpr(bst.rhs);
+
+                if(bst.lhs->getType() == AST::UNARY) {
+                    foldExpr(static_cast<UnaryAST&>(*bst.lhs).rhs);
+                }
+            } break;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<BlockAST&>(*ast).asts) {
+                    foldStatement(a);
+                }
+            } break;
+
+            case AST::IF: {
+                auto& ist = static_cast<IfAST&>(*ast);
+
+                foldExpr(ist.cond);
+                foldStatement(ist.body);
+
+                if(ist.alt) {
+                    foldStatement(ist.alt);
+                }
+
+                int32_t value;
+                AST::Type type;
+
+                if(getValue(*ist.cond, value, type)) {
+                    if(value != 0) {
+                        ast = std::move(ist.body);
+                    } else if(ist.alt) {
+                        ast = std::move(ist.alt);
+                    } else {
+                        ast = makeEmpty(ast->getPos());
+                    }
+
+                    changed = true;
+                }
+            } break;
+
+            case AST::WHILE: {
+                auto& wst = static_cast<WhileAST&>(*ast);
+
+                foldExpr(wst.cond);
+                foldStatement(wst.body);
+
+                int32_t value;
+                AST::Type type;
+
+                if(getValue(*wst.cond, value, type) && value == 0) {
+                    ast = makeEmpty(ast->getPos());
+                    changed = true;
+                }
+            } break;
+
+            case AST::CALL: {
+                foldExpr(ast);
+            } break;
+
+            case AST::RETURN: {
+                auto& value = static_cast<ReturnAST&>(*ast).value;
+
+                if(value) {
+                    foldExpr(value);
+                }
+            } break;
+
+            default: break;
+        }
+    }
+
+    // Counts assignments to each name, remembering the last value assigned
+    void countAssignments(const AST& ast, std::unordered_map<std::string, int>& counts, std::unordered_map<std::string, const AST*>& values)
+    {
+        switch(ast.getType()) {
+            case AST::BIN: {
+                auto& bst = static_cast<const BinAST&>(ast);
+
+                if(bst.getLhs().getType() == AST::ID) {
+                    auto& name = static_cast<const IdAST&>(bst.getLhs()).getName();
+
+                    counts[name] += 1;
+                    values[name] = &bst.getRhs();
+                }
+            } break;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    countAssignments(*a, counts, values);
+                }
+            } break;
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+
+                countAssignments(ist.getBody(), counts, values);
+
+                if(ist.getAlt()) {
+                    countAssignments(*ist.getAlt(), counts, values);
+                }
+            } break;
+
+            case AST::WHILE: {
+                countAssignments(static_cast<const WhileAST&>(ast).getBody(), counts, values);
+            } break;
+
+            default: break;
+        }
+    }
+
+    void countReads(const AST& ast, std::unordered_map<std::string, int>& reads)
+    {
+        switch(ast.getType()) {
+            case AST::ID: reads[static_cast<const IdAST&>(ast).getName()] += 1; break;
+
+            case AST::BIN: {
+                auto& bst = static_cast<const BinAST&>(ast);
+
+                // The left side of an assignment isn't a read
+                if(bst.getOp() != '=' || bst.getLhs().getType() != AST::ID) {
+                    countReads(bst.getLhs(), reads);
+                }
+
+                countReads(bst.getRhs(), reads);
+            } break;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<const BlockAST&>(ast).getAsts()) {
+                    countReads(*a, reads);
+                }
+            } break;
+
+            case AST::IF: {
+                auto& ist = static_cast<const IfAST&>(ast);
+
+                countReads(ist.getCond(), reads);
+                countReads(ist.getBody(), reads);
+
+                if(ist.getAlt()) {
+                    countReads(*ist.getAlt(), reads);
+                }
+            } break;
+
+            case AST::WHILE: {
+                auto& wst = static_cast<const WhileAST&>(ast);
+
+                countReads(wst.getCond(), reads);
+                countReads(wst.getBody(), reads);
+            } break;
+
+            case AST::CALL: {
+                for(auto& arg : static_cast<const CallAST&>(ast).getArgs()) {
+                    countReads(*arg, reads);
+                }
+            } break;
+
+            case AST::RETURN: {
+                auto value = static_cast<const ReturnAST&>(ast).getValue();
+
+                if(value) {
+                    countReads(*value, reads);
+                }
+            } break;
+
+            case AST::UNARY: countReads(static_cast<const UnaryAST&>(ast).getRhs(), reads); break;
+            case AST::PAREN: countReads(static_cast<const ParenAST&>(ast).getInner(), reads); break;
+            case AST::CAST: countReads(static_cast<const CastAST&>(ast).getValue(), reads); break;
+
+            default: break;
+        }
+    }
+
+    // Nothing reads these variables anymore, so their assignments can go
+    void removeAssignments(std::unique_ptr<AST>& ast, const std::unordered_set<std::string>& unread)
+    {
+        switch(ast->getType()) {
+            case AST::BIN: {
+                auto& bst = static_cast<BinAST&>(*ast);
+
+                if(bst.lhs->getType() == AST::ID && unread.count(static_cast<IdAST&>(*bst.lhs).getName())) {
+                    ast = makeEmpty(ast->getPos());
+                    changed = true;
+                }
+            } break;
+
+            case AST::BLOCK: {
+                for(auto& a : static_cast<BlockAST&>(*ast).asts) {
+                    removeAssignments(a, unread);
+                }
+            } break;
+
+            case AST::IF: {
+                auto& ist = static_cast<IfAST&>(*ast);
+
+                removeAssignments(ist.body, unread);
+
+                if(ist.alt) {
+                    removeAssignments(ist.alt, unread);
+                }
+            } break;
+
+            case AST::WHILE: {
+                removeAssignments(static_cast<WhileAST&>(*ast).body, unread);
+            } break;
+
+            default: break;
+        }
+    }
+
+    // Folds operations on locals that are only ever assigned one constant.
+    // Reads before the assignment would see an uninitialized value, so the
+    // constant is as good as anything there.
+    void propagate(const Func& func, std::unique_ptr<AST>& body)
+    {
+        do {
+            std::unordered_map<std::string, int> counts;
+            std::unordered_map<std::string, const AST*> values;
+
+            countAssignments(*body, counts, values);
+
+            known.clear();
+
+            for(auto& v : func.locals) {
+                auto found = counts.find(v.name);
+
+                if(found != counts.end() && found->second == 1 && isConst(*values[v.name])) {
+                    known[v.name] = {getConst(*values[v.name]), values[v.name]->getType()};
+                }
+            }
+
+            if(known.empty()) {
+                break;
+            }
+
+            changed = false;
+
+            // Which could make more constants
+            foldStatement(body);
+
+            std::unordered_map<std::string, int> reads;
+
+            countReads(*body, reads);
+
+            std::unordered_set<std::string> unread;
+
+            for(auto& k : known) {
+                if(!reads.count(k.first)) {
+                    unread.insert(k.first);
+                }
+            }
+
+            removeAssignments(body, unread);
+        } while(changed);
+
+        known.clear();
+    }
+};
@@ -221,7 +221,8 @@ class Parser
         auto lhs = parseUnary(table, s);
 		auto pos = lhs->getPos();
         
-        while(curTok == '*' || curTok == '/' || curTok == '%') {
+        // Shifts and & bind as tightly as *, and | and ^ as +
+        while(curTok == '*' || curTok == '/' || curTok == '%' || curTok == '&' || curTok == TOK_SHL || curTok == TOK_SHR) {
             int op = curTok;
 
             curTok = lexer.getToken(s);
@@ -239,7 +240,7 @@ class Parser
         auto lhs = parseFactor(table, s);
 		auto pos = lhs->getPos();
 
-        while(curTok == '+' || curTok == '-') {
+        while(curTok == '+' || curTok == '-' || curTok == '|' || curTok == '^') {
             int op = curTok;
 
             curTok = lexer.getToken(s);
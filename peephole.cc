@@ -0,0 +1,275 @@
+#include <string>
+#include <vector>
+
+// Cleans up finished code (after register allocation) by looking at a
+// couple of instructions at a time. Labels are never removed and no rule
+// looks across one (other than to see where a jump lands), so every branch
+// and jump target stays where it was.
+struct Peephole
+{
+    enum Rule
+    {
+        USELESS_COPY,   // add $a, $a, $0, or add $b, $a, $0 right after add $a, $b, $0
+        KNOWN_LIS,      // Loading a constant the register already holds
+        DEAD_WRITE,     // A result overwritten by the next instruction before it's read
+        STACK_ADJUST,   // Moving $30 and straight back (sub then add of $x, or two addis)
+        RELOAD,         // lw right after sw of the same register to the same stack slot
+        JUMP_NEXT,      // Jump or branch to the next instruction
+        RULE_COUNT
+    };
+
+    static const char* getRuleName(int rule)
+    {
+        static const char* names[RULE_COUNT] = {
+            "useless-copy", "known-lis", "dead-write", "stack-adjust", "reload", "jump-next"
+        };
+
+        return names[rule];
+    }
+
+    void run(Codegen& gen)
+    {
+        auto code = gen.getCode();
+
+        // Numeric branch offsets (from top level asm) would go stale otherwise
+        Codegen::labelBranches(code, "peepholeXXXX");
+
+        while(pass(code)) {}
+
+        gen.setCode(std::move(code));
+    }
+
+    // How many instructions the rule removed (lis and its word count as one)
+    size_t getRemoved(int rule) const
+    {
+        return removed[rule];
+    }
+
+private:
+    typedef Codegen::Op Op;
+
+    size_t removed[RULE_COUNT] = {};
+
+    // What a register is known to hold: a number, or the address of a label
+    struct Known
+    {
+        bool valid = false;
+        int32_t value = 0;
+        std::string label;
+
+        bool operator==(const Known& other) const
+        {
+            return valid && other.valid && value == other.value && label == other.label;
+        }
+    };
+
+    static bool isInstr(const Op& op, Instruction::Type type)
+    {
+        return op.kind == Op::INSTR && op.type == type;
+    }
+
+    // The register op writes, or -1
+    static int getWritten(const Op& op)
+    {
+        return op.kind == Op::INSTR ? Codegen::getWritten(op) : -1;
+    }
+
+    static bool reads(const Op& op, int reg)
+    {
+        return (Codegen::readsS(op.type) && op.s == reg) || (Codegen::readsT(op.type) && op.t == reg);
+    }
+
+    // True if label is on the instruction at index i (or further labels before it)
+    static bool labels(const std::vector<Op>& code, size_t i, const std::string& label)
+    {
+        for(; i < code.size() && code[i].kind == Op::LABEL; ++i) {
+            if(code[i].label == label) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Returns true if it changed anything
+    bool pass(std::vector<Op>& code)
+    {
+        std::vector<Op> result;
+        result.reserve(code.size());
+
+        Known known[32];
+
+        auto forgetAll = [&]() {
+            for(int r = 1; r < 32; ++r) {
+                known[r] = {};
+            }
+        };
+
+        known[0].valid = true;
+
+        bool changed = false;
+
+        auto remove = [&](Rule rule, size_t& i, size_t count, size_t instrs) {
+            removed[rule] += instrs;
+            i += count;
+            changed = true;
+        };
+
+        for(size_t i = 0; i < code.size();) {
+            auto& op = code[i];
+
+            if(op.kind != Op::INSTR) {
+                // Anything could jump to a label
+                if(op.kind == Op::LABEL) {
+                    forgetAll();
+                }
+
+                result.push_back(op);
+                ++i;
+                continue;
+            }
+
+            bool hasWord = op.type == Instruction::LIS && i + 1 < code.size() && code[i + 1].kind == Op::WORD;
+
+            auto next = i + (hasWord ? 2 : 1);
+            auto width = next - i;
+
+            auto written = getWritten(op);
+
+            // The write to $0 does nothing anyway, and a load might be reading a device
+            if(written > 0 && op.type != Instruction::LW && op.type != Instruction::LB && (op.type != Instruction::LIS || hasWord) && next < code.size()) {
+                auto& nextOp = code[next];
+
+                if(getWritten(nextOp) == written && !reads(nextOp, written)) {
+                    remove(DEAD_WRITE, i, width, 1);
+                    continue;
+                }
+            }
+
+            switch(op.type) {
+                case Instruction::LIS: {
+                    if(!hasWord) {
+                        break;
+                    }
+
+                    Known value;
+
+                    value.valid = true;
+                    value.value = code[i + 1].label.empty() ? code[i + 1].imm : 0;
+                    value.label = code[i + 1].label;
+
+                    if(op.d != 0 && known[op.d] == value) {
+                        remove(KNOWN_LIS, i, 2, 1);
+                        continue;
+                    }
+
+                    if(!value.label.empty() && next < code.size() && isInstr(code[next], Instruction::JR) &&
+                       code[next].s == op.d && labels(code, next + 1, value.label)) {
+                        remove(JUMP_NEXT, i, 3, 2);
+                        continue;
+                    }
+                } break;
+
+                case Instruction::ADD: {
+                    if(op.t != 0) {
+                        break;
+                    }
+
+                    if(op.d == op.s) {
+                        remove(USELESS_COPY, i, 1, 1);
+                        continue;
+                    }
+
+                    if(!result.empty() && isInstr(result.back(), Instruction::ADD) && result.back().t == 0 &&
+                       result.back().d == op.s && result.back().s == op.d) {
+                        remove(USELESS_COPY, i, 1, 1);
+                        continue;
+                    }
+                } break;
+
+                case Instruction::SUB: {
+                    if(op.d == SP_REG && op.s == SP_REG && op.t != SP_REG && next < code.size()) {
+                        auto& nextOp = code[next];
+
+                        if(isInstr(nextOp, Instruction::ADD) && nextOp.d == SP_REG && nextOp.s == SP_REG && nextOp.t == op.t) {
+                            remove(STACK_ADJUST, i, 2, 2);
+                            continue;
+                        }
+                    }
+                } break;
+
+                case Instruction::LW: {
+                    if(op.s == SP_REG && op.t != SP_REG && !result.empty()) {
+                        auto& prev = result.back();
+
+                        if(isInstr(prev, Instruction::SW) && prev.s == op.s && prev.t == op.t && prev.imm == op.imm) {
+                            remove(RELOAD, i, 1, 1);
+                            continue;
+                        }
+                    }
+                } break;
+
+                case Instruction::ADDI: {
+                    // Constants loaded with addi (see Codegen::li) are tracked like lis
+                    if(op.s == 0 && op.d != 0) {
+                        Known value;
+
+                        value.valid = true;
+                        value.value = op.imm;
+
+                        if(known[op.d] == value) {
+                            remove(KNOWN_LIS, i, 1, 1);
+                            continue;
+                        }
+                    }
+
+                    if(op.d == SP_REG && op.s == SP_REG && next < code.size()) {
+                        auto& nextOp = code[next];
+
+                        if(isInstr(nextOp, Instruction::ADDI) && nextOp.d == SP_REG && nextOp.s == SP_REG && nextOp.imm == -op.imm) {
+                            remove(STACK_ADJUST, i, 2, 2);
+                            continue;
+                        }
+                    }
+                } break;
+
+                default: {
+                    if(Codegen::isBranch(op.type) && !op.label.empty() && labels(code, next, op.label)) {
+                        remove(JUMP_NEXT, i, 1, 1);
+                        continue;
+                    }
+                } break;
+            }
+
+            for(size_t j = i; j < next; ++j) {
+                result.push_back(code[j]);
+            }
+
+            // Keep track of what's in the registers
+            if(op.type == Instruction::JR || op.type == Instruction::JALR || Codegen::isJump(op)) {
+                forgetAll();
+            } else if(written > 0) {
+                Known value;
+
+                if(hasWord) {
+                    value.valid = true;
+                    value.value = code[i + 1].label.empty() ? code[i + 1].imm : 0;
+                    value.label = code[i + 1].label;
+                } else if(op.type == Instruction::ADD && op.t == 0) {
+                    value = known[op.s];
+                } else if(op.type == Instruction::ADDI && op.s == 0) {
+                    value.valid = true;
+                    value.value = op.imm;
+                }
+
+                known[written] = value;
+            }
+
+            i = next;
+        }
+
+        code = std::move(result);
+
+        return changed;
+    }
+};
@@ -0,0 +1,144 @@
+#include <ostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+// Folds the per-word counts from an ExecProfile into totals for every label
+// and every function, and writes them out sorted by self instruction count.
+struct Profiler
+{
+    Profiler(const ExecProfile& profile, const Codegen& gen, SymbolTable& table) : profile{profile}
+    {
+        // Several labels can share an address (e.g. a function and the first
+        // label in its body), so group them
+        std::map<int, std::string> labelNames;
+        std::map<int, std::string> funcNames;
+
+        for(auto& label : gen.getLabels()) {
+            auto& name = labelNames[label.second];
+            name = name.empty() ? label.first : name + "/" + label.first;
+
+            if(table.getFunc(label.first)) {
+                funcNames[label.second] = label.first;
+            }
+        }
+
+        auto words = profile.counts.size();
+
+        wordLabel.assign(words, "<startup>");
+        wordLabelStart.assign(words, 0);
+        wordFunc.assign(words, "<startup>");
+
+        for(size_t i = 0; i < words; ++i) {
+            auto label = labelNames.upper_bound(static_cast<int>(i));
+
+            if(label != labelNames.begin()) {
+                wordLabel[i] = std::prev(label)->second;
+                wordLabelStart[i] = std::prev(label)->first;
+            }
+
+            auto func = funcNames.upper_bound(static_cast<int>(i));
+            if(func != funcNames.begin()) wordFunc[i] = std::prev(func)->second;
+        }
+    }
+
+    // Human-readable report
+    void writeReport(std::ostream& out) const
+    {
+        auto total = getTotal();
+
+        out << "Profile: " << total << " instructions retired\n";
+
+        writeTotals(out, "Functions", sumBy(wordFunc), total);
+        writeTotals(out, "Labels", sumBy(wordLabel), total);
+
+        std::vector<std::pair<uint64_t, size_t>> branches;
+
+        for(size_t i = 0; i < profile.taken.size(); ++i) {
+            if(profile.taken[i] > 0) {
+                branches.emplace_back(profile.taken[i], i);
+            }
+        }
+
+        std::sort(branches.rbegin(), branches.rend());
+
+        out << "\nTaken branches\n";
+
+        for(auto& b : branches) {
+            out << std::setw(14) << b.first << " of " << std::setw(14) << profile.counts[b.second] << "  "
+                << wordLabel[b.second] << "+" << b.second - wordLabelStart[b.second] << " (" << b.second * sizeof(Instruction) << ")\n";
+        }
+    }
+
+    // One tab-separated record per line: kind, name, address, count, taken.
+    // Kinds are func, label and pc; only pc records have an address and a
+    // taken count.
+    void writeData(std::ostream& out) const
+    {
+        out << "kind\tname\taddress\tcount\ttaken\n";
+
+        for(auto& t : sumBy(wordFunc)) out << "func\t" << t.second << "\t\t" << t.first << "\t\n";
+        for(auto& t : sumBy(wordLabel)) out << "label\t" << t.second << "\t\t" << t.first << "\t\n";
+
+        for(size_t i = 0; i < profile.counts.size(); ++i) {
+            if(profile.counts[i] > 0) {
+                out << "pc\t" << wordLabel[i] << "\t" << i * sizeof(Instruction) << "\t" << profile.counts[i] << "\t" << profile.taken[i] << "\n";
+            }
+        }
+    }
+
+private:
+    const ExecProfile& profile;
+
+    // Innermost label (and where it starts) and enclosing function for every word
+    std::vector<std::string> wordLabel;
+    std::vector<size_t> wordLabelStart;
+    std::vector<std::string> wordFunc;
+
+    uint64_t getTotal() const
+    {
+        uint64_t total = 0;
+
+        for(auto c : profile.counts) {
+            total += c;
+        }
+
+        return total;
+    }
+
+    // Sums counts by the given name for each word, sorted by count descending
+    std::vector<std::pair<uint64_t, std::string>> sumBy(const std::vector<std::string>& names) const
+    {
+        std::map<std::string, uint64_t> sums;
+
+        for(size_t i = 0; i < profile.counts.size(); ++i) {
+            if(profile.counts[i] > 0) {
+                sums[names[i]] += profile.counts[i];
+            }
+        }
+
+        std::vector<std::pair<uint64_t, std::string>> result;
+
+        for(auto& s : sums) {
+            result.emplace_back(s.second, s.first);
+        }
+
+        std::sort(result.begin(), result.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+
+        return result;
+    }
+
+    static void writeTotals(std::ostream& out, const char* title, const std::vector<std::pair<uint64_t, std::string>>& totals, uint64_t total)
+    {
+        out << "\n" << title << " (self)\n";
+
+        for(auto& t : totals) {
+            out << std::setw(14) << t.first << "  " << std::fixed << std::setprecision(2) << std::setw(6)
+                << (total ? 100.0 * t.first / total : 0.0) << "%  " << t.second << "\n";
+        }
+    }
+};
@@ -0,0 +1,801 @@
+#include <vector>
+#include <string>
+#include <climits>
+#include <algorithm>
+#include <unordered_map>
+
+// Register conventions for compiled code. Arguments are passed in $1 onwards
+// and the return value comes back in RETVAL_REG. A call may clobber any
+// register but $30, and each function keeps $31 in its frame.
+const int RETVAL_REG = 29;
+
+// Spilled registers are loaded into (and stored from) these around each use
+const int SCRATCH_REG_A = 27;
+const int SCRATCH_REG_B = 28;
+
+// Registers 1 up to this one are handed out to virtual registers
+const int MAX_ALLOC_REG = 26;
+
+// Arguments after this many are passed on the stack
+const int ARG_REG_COUNT = 8;
+
+const int SP_REG = 30;
+const int LINK_REG = 31;
+
+// A set of real registers, with bit r set for $r
+typedef uint32_t RegMask;
+
+// What a call to a function we know nothing about might change
+const RegMask ALL_REGS_MASK = ((RegMask{1} << (RETVAL_REG + 1)) - 1) & ~RegMask{1};
+
+// A set of registers, real and virtual
+struct RegSet
+{
+    explicit RegSet(int count = 0) : bits((count + 63) / 64) {}
+
+    bool has(int r) const { return (bits[r >> 6] >> (r & 63)) & 1; }
+    void insert(int r) { bits[r >> 6] |= uint64_t{1} << (r & 63); }
+    void erase(int r) { bits[r >> 6] &= ~(uint64_t{1} << (r & 63)); }
+
+    // Adds everything in other, returning true if that changed anything
+    bool merge(const RegSet& other)
+    {
+        bool changed = false;
+
+        for(size_t i = 0; i < bits.size(); ++i) {
+            auto merged = bits[i] | other.bits[i];
+            changed = changed || merged != bits[i];
+            bits[i] = merged;
+        }
+
+        return changed;
+    }
+
+    // Calls f with every register in the set
+    template<typename F>
+    void forEach(F f) const
+    {
+        for(size_t i = 0; i < bits.size(); ++i) {
+            for(auto word = bits[i]; word; word &= word - 1) {
+                f(static_cast<int>(i * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+
+    std::vector<uint64_t> bits;
+};
+
+// Maps the virtual registers in one function's code onto real ones using
+// linear scan over live intervals, spilling to the stack when it runs out,
+// then lowers the function's calls and returns. The frame sits just below
+// the caller's $30:
+//
+//     $30 + 0                  arguments passed on the stack to callees
+//     ...                      spill slots
+//     ...                      where registers are saved across calls
+//     ...                      local arrays
+//     $30 + frameSize - 4      the caller's $31
+//
+// so a function finds its own stack arguments just past the end of its frame.
+//
+// Real registers in the code (arguments, asm) stay where they are, and no
+// virtual register is given one while it's live.
+//
+// clobbers holds the registers each function already allocated can change,
+// including through its own calls. A call only saves the registers the
+// callee can change, and values live across calls are kept out of those
+// registers where possible.
+struct RegAlloc
+{
+    explicit RegAlloc(const std::unordered_map<std::string, RegMask>& clobbers) : clobbers(clobbers) {}
+
+    // localBytes is how much room the function's local arrays need
+    Codegen run(const std::string& funcName, const Codegen& body, int32_t localBytes)
+    {
+        ops = body.getCode();
+
+        this->localBytes = localBytes;
+        outgoingCount = 0;
+
+        for(auto& op : ops) {
+            if(op.kind == Op::CALL) {
+                outgoingCount = std::max(outgoingCount, op.imm - ARG_REG_COUNT);
+            }
+        }
+
+        Codegen::labelBranches(ops, funcName);
+        coalesce();
+        allocate();
+
+        return lower(funcName);
+    }
+
+    // The registers the function run last can change (valid after run)
+    RegMask getClobbers() const
+    {
+        return clobbered;
+    }
+
+private:
+    typedef Codegen::Op Op;
+
+    const std::unordered_map<std::string, RegMask>& clobbers;
+
+    std::vector<Op> ops;
+
+    RegMask clobbered = 0;
+
+    int32_t localBytes = 0;
+
+    // Most arguments any call passes on the stack
+    int32_t outgoingCount = 0;
+
+    // One past the highest register in ops
+    int regCount = 0;
+
+    std::vector<std::vector<int>> uses, defs;
+    std::vector<std::vector<size_t>> succs;
+    std::vector<bool> unknownExit;
+    std::vector<RegSet> liveIn, liveOut;
+
+    // Where each virtual register ended up: a real register, or 0 and a spill slot
+    std::vector<int> regOf;
+    std::vector<int> slotOf;
+    int spillCount = 0;
+
+    static bool isVirtual(int r) { return r >= FIRST_VREG; }
+
+    RegMask getCalleeClobbers(const std::string& name) const
+    {
+        auto found = clobbers.find(name);
+
+        // Not allocated yet, which means it's recursive
+        return found != clobbers.end() ? found->second : ALL_REGS_MASK;
+    }
+
+    static bool isCopy(const Op& op)
+    {
+        return op.kind == Op::INSTR && op.type == Instruction::ADD && op.t == 0;
+    }
+
+    // $0, $30 and $31 are never handed out, so there's no need to track them
+    static bool isTracked(int r)
+    {
+        return r != 0 && r != SP_REG && r != LINK_REG;
+    }
+
+    void getUsesDefs(const Op& op, std::vector<int>& u, std::vector<int>& d) const
+    {
+        u.clear();
+        d.clear();
+
+        auto use = [&](int r) { if(isTracked(r)) u.push_back(r); };
+        auto def = [&](int r) { if(isTracked(r)) d.push_back(r); };
+
+        switch(op.kind) {
+            case Op::INSTR: {
+                if(op.type == Instruction::JALR) {
+                    // Could be calling anything
+                    use(op.s);
+
+                    for(int r = 1; r <= RETVAL_REG; ++r) {
+                        def(r);
+                    }
+
+                    break;
+                }
+
+                if(Codegen::readsS(op.type)) use(op.s);
+                if(Codegen::readsT(op.type)) use(op.t);
+
+                auto written = Codegen::getWritten(op);
+
+                if(written >= 0) def(written);
+            } break;
+
+            case Op::ARG: case Op::FRAME: def(op.d); break;
+
+            case Op::CALL: {
+                for(int r = 1; r <= std::min(op.imm, ARG_REG_COUNT); ++r) {
+                    use(r);
+                }
+
+                // Anything else the callee clobbers is saved around the call
+                def(RETVAL_REG);
+            } break;
+
+            case Op::TAIL_CALL: {
+                for(int r = 1; r <= op.imm; ++r) {
+                    use(r);
+                }
+            } break;
+
+            case Op::RET: {
+                if(op.imm) use(RETVAL_REG);
+            } break;
+
+            default: break;
+        }
+    }
+
+    void computeLiveness()
+    {
+        regCount = FIRST_VREG;
+
+        for(auto& op : ops) {
+            regCount = std::max({regCount, op.s + 1, op.t + 1, op.d + 1});
+        }
+
+        auto n = ops.size();
+
+        std::unordered_map<std::string, size_t> labelIndex;
+
+        for(size_t i = 0; i < n; ++i) {
+            if(ops[i].kind == Op::LABEL) {
+                labelIndex[ops[i].label] = i;
+            }
+        }
+
+        auto target = [&](const std::string& name) {
+            auto found = labelIndex.find(name);
+
+            if(found == labelIndex.end()) {
+                throw std::runtime_error{"Referenced undefined label " + name};
+            }
+
+            return found->second;
+        };
+
+        uses.resize(n);
+        defs.resize(n);
+        succs.assign(n, {});
+        unknownExit.assign(n, false);
+
+        for(size_t i = 0; i < n; ++i) {
+            auto& op = ops[i];
+
+            getUsesDefs(op, uses[i], defs[i]);
+
+            bool fallsThrough = true;
+
+            if(op.kind == Op::RET || op.kind == Op::TAIL_CALL) {
+                fallsThrough = false;
+            } else if(op.kind == Op::INSTR) {
+                if(Codegen::isBranch(op.type)) {
+                    succs[i].push_back(target(op.label));
+                    fallsThrough = !Codegen::isJump(op);
+                } else if(op.type == Instruction::JR) {
+                    fallsThrough = false;
+
+                    // lis $r; .word label; jr $r is a jump to label; anything else could go anywhere
+                    if(i >= 2 && ops[i - 2].kind == Op::INSTR && ops[i - 2].type == Instruction::LIS && ops[i - 2].d == op.s &&
+                       ops[i - 1].kind == Op::WORD && !ops[i - 1].label.empty()) {
+                        succs[i].push_back(target(ops[i - 1].label));
+                    } else {
+                        unknownExit[i] = true;
+                    }
+                }
+            }
+
+            if(fallsThrough && i + 1 < n) {
+                succs[i].push_back(i + 1);
+            }
+        }
+
+        RegSet allReal{regCount};
+
+        for(int r = 1; r <= RETVAL_REG; ++r) {
+            allReal.insert(r);
+        }
+
+        liveIn.assign(n, RegSet{regCount});
+        liveOut.assign(n, RegSet{regCount});
+
+        bool changed = true;
+
+        while(changed) {
+            changed = false;
+
+            for(size_t i = n; i-- > 0;) {
+                auto& out = liveOut[i];
+
+                if(unknownExit[i]) {
+                    out.merge(allReal);
+                }
+
+                for(auto s : succs[i]) {
+                    out.merge(liveIn[s]);
+                }
+
+                RegSet in = out;
+
+                for(auto r : defs[i]) in.erase(r);
+                for(auto r : uses[i]) in.insert(r);
+
+                if(liveIn[i].merge(in)) {
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Two registers interfere if one is live where the other is written,
+    // not counting copies between them
+    bool interferes(int a, int b, const std::vector<std::vector<size_t>>& defSites) const
+    {
+        auto check = [&](int x, int y) {
+            for(auto i : defSites[x]) {
+                auto& op = ops[i];
+
+                if(isCopy(op) && ((op.d == x && op.s == y) || (op.d == y && op.s == x))) {
+                    continue;
+                }
+
+                if(liveOut[i].has(y)) {
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        return check(a, b) || check(b, a);
+    }
+
+    // Merges virtual registers joined by a copy (add $d, $s, $0) whenever they
+    // don't interfere, which gets rid of the copy. The compiler copies every
+    // local it reads, so this removes most of them.
+    void coalesce()
+    {
+        while(true) {
+            computeLiveness();
+
+            std::vector<std::vector<size_t>> defSites(regCount);
+
+            for(size_t i = 0; i < ops.size(); ++i) {
+                for(auto r : defs[i]) {
+                    defSites[r].push_back(i);
+                }
+            }
+
+            std::vector<int> rename(regCount);
+
+            for(int r = 0; r < regCount; ++r) {
+                rename[r] = r;
+            }
+
+            // Liveness is only right for registers that haven't been merged yet
+            std::vector<bool> touched(regCount, false);
+
+            bool merged = false;
+
+            for(auto& op : ops) {
+                if(!isCopy(op) || !isVirtual(op.d) || !isVirtual(op.s) || op.d == op.s ||
+                   touched[op.d] || touched[op.s]) {
+                    continue;
+                }
+
+                if(!interferes(op.d, op.s, defSites)) {
+                    rename[op.s] = op.d;
+                    touched[op.s] = touched[op.d] = true;
+                    merged = true;
+                }
+            }
+
+            if(!merged) {
+                break;
+            }
+
+            std::vector<Op> renamed;
+
+            for(auto& op : ops) {
+                auto r = op;
+
+                r.s = rename[r.s];
+                r.t = rename[r.t];
+                r.d = rename[r.d];
+
+                if(isCopy(r) && r.d == r.s) {
+                    continue;
+                }
+
+                renamed.push_back(std::move(r));
+            }
+
+            ops = std::move(renamed);
+        }
+    }
+
+    void allocate()
+    {
+        computeLiveness();
+
+        // Each op gets two positions: one where it reads, then one where it writes
+        auto positions = ops.size() * 2;
+
+        std::vector<int> start(regCount, INT_MAX), end(regCount, -1);
+
+        // For each real register, positions where it's live (or written) in the code as is
+        std::vector<std::vector<int>> busy(MAX_ALLOC_REG + 1, std::vector<int>(positions + 1, 0));
+
+        auto mark = [&](int r, size_t pos) {
+            if(isVirtual(r)) {
+                start[r] = std::min(start[r], static_cast<int>(pos));
+                end[r] = std::max(end[r], static_cast<int>(pos));
+            } else if(r >= 1 && r <= MAX_ALLOC_REG) {
+                busy[r][pos + 1] = 1;
+            }
+        };
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            liveIn[i].forEach([&](int r) { mark(r, i * 2); });
+            liveOut[i].forEach([&](int r) { mark(r, i * 2 + 1); });
+
+            for(auto r : uses[i]) mark(r, i * 2);
+            for(auto r : defs[i]) mark(r, i * 2 + 1);
+        }
+
+        // Turn busy into running counts so checking a range is constant time
+        for(auto& b : busy) {
+            for(size_t p = 1; p < b.size(); ++p) {
+                b[p] += b[p - 1];
+            }
+        }
+
+        // Copies are free if both sides get the same register
+        std::vector<std::vector<int>> hints(regCount);
+
+        for(auto& op : ops) {
+            if(isCopy(op)) {
+                if(isVirtual(op.d)) hints[op.d].push_back(op.s);
+                if(isVirtual(op.s)) hints[op.s].push_back(op.d);
+            }
+        }
+
+        std::vector<int> order;
+
+        for(int r = FIRST_VREG; r < regCount; ++r) {
+            if(end[r] >= 0) {
+                order.push_back(r);
+            }
+        }
+
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return start[a] < start[b]; });
+
+        regOf.assign(regCount, 0);
+        slotOf.assign(regCount, -1);
+        spillCount = 0;
+
+        auto fits = [&](int reg, int v) {
+            return busy[reg][end[v] + 1] - busy[reg][start[v]] == 0;
+        };
+
+        // Likewise, running counts of the calls which change each register
+        std::vector<std::vector<int>> callClobbers(MAX_ALLOC_REG + 1, std::vector<int>(positions + 1, 0));
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            if(ops[i].kind == Op::CALL) {
+                auto mask = getCalleeClobbers(ops[i].label);
+
+                for(int r = 1; r <= MAX_ALLOC_REG; ++r) {
+                    if(mask & (RegMask{1} << r)) {
+                        callClobbers[r][i * 2 + 2] = 1;
+                    }
+                }
+            }
+        }
+
+        for(auto& c : callClobbers) {
+            for(size_t p = 1; p < c.size(); ++p) {
+                c[p] += c[p - 1];
+            }
+        }
+
+        // True if the register would have to be saved around a call while holding v
+        auto crossesCall = [&](int reg, int v) {
+            return callClobbers[reg][end[v] + 1] - callClobbers[reg][start[v]] != 0;
+        };
+
+        auto spill = [&](int v) {
+            regOf[v] = 0;
+            slotOf[v] = spillCount++;
+        };
+
+        std::vector<int> active;
+
+        for(auto v : order) {
+            active.erase(std::remove_if(active.begin(), active.end(), [&](int a) { return end[a] < start[v]; }), active.end());
+
+            bool taken[MAX_ALLOC_REG + 1] = {};
+
+            for(auto a : active) {
+                taken[regOf[a]] = true;
+            }
+
+            auto usable = [&](int reg) {
+                return reg >= 1 && reg <= MAX_ALLOC_REG && !taken[reg] && fits(reg, v);
+            };
+
+            // Saving a register around a call costs more than the copy a hint saves
+            auto pick = [&](bool avoidCalls) {
+                for(auto h : hints[v]) {
+                    auto reg = isVirtual(h) ? regOf[h] : h;
+
+                    if(usable(reg) && !(avoidCalls && crossesCall(reg, v))) {
+                        return reg;
+                    }
+                }
+
+                for(int reg = 1; reg <= MAX_ALLOC_REG; ++reg) {
+                    if(usable(reg) && !(avoidCalls && crossesCall(reg, v))) {
+                        return reg;
+                    }
+                }
+
+                return 0;
+            };
+
+            int chosen = pick(true);
+
+            if(!chosen) {
+                chosen = pick(false);
+            }
+
+            if(!chosen) {
+                // Spill whichever interval that could make room lasts longest
+                int victim = -1;
+
+                for(auto a : active) {
+                    if(end[a] > end[v] && fits(regOf[a], v) && (victim < 0 || end[a] > end[victim])) {
+                        victim = a;
+                    }
+                }
+
+                if(victim < 0) {
+                    spill(v);
+                    continue;
+                }
+
+                chosen = regOf[victim];
+
+                spill(victim);
+                active.erase(std::find(active.begin(), active.end(), victim));
+            }
+
+            regOf[v] = chosen;
+            active.push_back(v);
+        }
+    }
+
+    // Where the spill slots start in the frame
+    int32_t getSpillBase() const
+    {
+        return outgoingCount * static_cast<int32_t>(sizeof(Instruction));
+    }
+
+    // Replaces virtual registers with their real ones, loading and storing
+    // spilled ones through the scratch registers
+    std::vector<Op> rewrite() const
+    {
+        std::vector<Op> result;
+
+        auto slotOffset = [&](int v) { return getSpillBase() + static_cast<int32_t>(slotOf[v] * sizeof(Instruction)); };
+
+        auto load = [&](int reg, int v) {
+            result.push_back(Op{Op::INSTR, Instruction::LW, SP_REG, reg, 0, slotOffset(v), {}});
+        };
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            auto op = ops[i];
+
+            bool instr = op.kind == Op::INSTR;
+
+            if(!instr && op.kind != Op::ARG && op.kind != Op::FRAME) {
+                result.push_back(std::move(op));
+                continue;
+            }
+
+            bool readsS = instr && Codegen::readsS(op.type);
+            bool readsT = instr && Codegen::readsT(op.type);
+
+            // ARG and FRAME write d
+            int& written = instr && (op.type == Instruction::LW || op.type == Instruction::LB) ? op.t : op.d;
+            bool writes = !instr || Codegen::getWritten(op) >= 0;
+
+            int original = written;
+            int store = -1;
+
+            if(readsS && isVirtual(op.s)) {
+                auto v = op.s;
+
+                if(regOf[v]) {
+                    op.s = regOf[v];
+                } else {
+                    load(SCRATCH_REG_A, v);
+                    op.s = SCRATCH_REG_A;
+                }
+
+                if(readsT && op.t == v) {
+                    op.t = op.s;
+                }
+            }
+
+            if(readsT && isVirtual(op.t)) {
+                auto v = op.t;
+
+                if(regOf[v]) {
+                    op.t = regOf[v];
+                } else {
+                    load(SCRATCH_REG_B, v);
+                    op.t = SCRATCH_REG_B;
+                }
+            }
+
+            if(writes && isVirtual(original)) {
+                if(regOf[original]) {
+                    written = regOf[original];
+                } else {
+                    written = SCRATCH_REG_A;
+                    store = original;
+                }
+            }
+
+            // Copies which ended up in place do nothing, other than the
+            // store when both sides are spilled (and so went through $27)
+            if(isCopy(op) && op.d == op.s && store < 0) {
+                continue;
+            }
+
+            result.push_back(op);
+
+            if(store >= 0) {
+                // A LIS's constant comes right after it
+                if(instr && op.type == Instruction::LIS && i + 1 < ops.size()) {
+                    result.push_back(ops[++i]);
+                }
+
+                result.push_back(Op{Op::INSTR, Instruction::SW, SP_REG, SCRATCH_REG_A, 0, slotOffset(store), {}});
+            }
+        }
+
+        return result;
+    }
+
+    // Moves the stack pointer by amount bytes. $31 is free whenever this
+    // happens (it's saved or about to be restored), so it holds big amounts.
+    static void adjustStack(Codegen& gen, int32_t amount)
+    {
+        if(amount >= -32768 && amount <= 32767) {
+            gen.addi(SP_REG, SP_REG, amount);
+        } else {
+            gen.lis(LINK_REG, amount);
+            gen.add(SP_REG, SP_REG, LINK_REG);
+        }
+    }
+
+    Codegen lower(const std::string& funcName)
+    {
+        ops = rewrite();
+
+        // Only registers which hold something still needed after a call, and
+        // which the callee can change, are saved around it (spilled values
+        // are already on the stack)
+        computeLiveness();
+
+        clobbered = 0;
+
+        for(auto& op : ops) {
+            if(op.kind == Op::CALL) {
+                clobbered |= getCalleeClobbers(op.label) | (RegMask{1} << RETVAL_REG);
+            } else if(op.kind == Op::TAIL_CALL) {
+                // Our caller sees whatever the callee changes, as well as the register we jump through
+                clobbered |= getCalleeClobbers(op.label) | (RegMask{1} << RETVAL_REG) | (RegMask{1} << SCRATCH_REG_A);
+            } else if(op.kind == Op::ARG || op.kind == Op::FRAME) {
+                clobbered |= RegMask{1} << op.d;
+            } else if(op.kind == Op::INSTR) {
+                // Only asm calls anything with jalr, and it could be anything
+                if(op.type == Instruction::JALR) {
+                    clobbered |= ALL_REGS_MASK;
+                } else if(Codegen::getWritten(op) >= 0) {
+                    clobbered |= RegMask{1} << Codegen::getWritten(op);
+                }
+            }
+        }
+
+        // $30 and $31 always come back the way they were
+        clobbered &= ALL_REGS_MASK;
+
+        std::vector<std::vector<int>> savedAt(ops.size());
+        size_t saveSlots = 0;
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            if(ops[i].kind != Op::CALL) {
+                continue;
+            }
+
+            auto mask = getCalleeClobbers(ops[i].label);
+
+            liveOut[i].forEach([&](int r) {
+                if(r >= 1 && r <= MAX_ALLOC_REG && (mask & (RegMask{1} << r))) {
+                    savedAt[i].push_back(r);
+                }
+            });
+
+            saveSlots = std::max(saveSlots, savedAt[i].size());
+        }
+
+        const int32_t isize = sizeof(Instruction);
+
+        auto saveBase = getSpillBase() + spillCount * isize;
+
+        auto localBase = saveBase + static_cast<int32_t>(saveSlots * isize);
+
+        // Everything below the local arrays is reached with lw/sw offsets
+        if(localBase > 32767) {
+            throw std::runtime_error{"The stack frame for " + funcName + " is too big"};
+        }
+
+        int32_t frameSize = localBase + localBytes + isize;
+
+        Codegen gen;
+
+        gen.labelHere(funcName);
+
+        gen.sw(LINK_REG, -isize, SP_REG);
+        adjustStack(gen, -frameSize);
+
+        for(size_t i = 0; i < ops.size(); ++i) {
+            auto& op = ops[i];
+
+            if(op.kind == Op::CALL) {
+                auto& saved = savedAt[i];
+
+                for(size_t j = 0; j < saved.size(); ++j) {
+                    gen.sw(saved[j], static_cast<int16_t>(saveBase + j * isize), SP_REG);
+                }
+
+                gen.lis(LINK_REG, op.label);
+                gen.jalr(LINK_REG);
+
+                for(size_t j = 0; j < saved.size(); ++j) {
+                    gen.lw(saved[j], static_cast<int16_t>(saveBase + j * isize), SP_REG);
+                }
+            } else if(op.kind == Op::ARG) {
+                auto offset = frameSize + op.imm * isize;
+
+                if(offset <= 32767) {
+                    gen.lw(op.d, static_cast<int16_t>(offset), SP_REG);
+                } else {
+                    // Past big local arrays
+                    gen.lis(op.d, offset);
+                    gen.add(op.d, op.d, SP_REG);
+                    gen.lw(op.d, 0, op.d);
+                }
+            } else if(op.kind == Op::FRAME) {
+                auto offset = localBase + op.imm;
+
+                if(offset <= 32767) {
+                    gen.addi(op.d, SP_REG, offset);
+                } else {
+                    gen.lis(op.d, offset);
+                    gen.add(op.d, op.d, SP_REG);
+                }
+            } else if(op.kind == Op::TAIL_CALL) {
+                // Our frame is gone by the time the callee makes its own, and
+                // $31 still holds our return address when it saves it
+                gen.lis(SCRATCH_REG_A, op.label);
+                adjustStack(gen, frameSize);
+                gen.lw(LINK_REG, -isize, SP_REG);
+                gen.jr(SCRATCH_REG_A);
+            } else if(op.kind == Op::RET) {
+                adjustStack(gen, frameSize);
+                gen.lw(LINK_REG, -isize, SP_REG);
+                gen.jr(LINK_REG);
+            } else {
+                gen.push(op);
+            }
+        }
+
+        return gen;
+    }
+};
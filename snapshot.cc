@@ -0,0 +1,240 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#define WAT_SNAPSHOT_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Snapshot files hold a machine stopped at a checkpoint, in host byte order:
+//
+//   SnapshotHeader
+//   uint32_t pageNumbers[pageCount]
+//   padding up to a multiple of SNAPSHOT_ALIGN
+//   pageCount pages of Memory::PAGE_SIZE bytes
+//
+// Pages that were never touched or are all zero are left out. The page data is
+// aligned so a restore can map it straight from the file copy-on-write.
+// The digit goes up whenever the instruction encoding or this layout changes.
+const char snapshotMagic[8] = {'W', 'A', 'T', 'S', 'N', 'A', 'P', '3'};
+const uint32_t SNAPSHOT_ALIGN = 1 << 16;
+
+struct SnapshotHeader
+{
+    char magic[8];
+
+    uint32_t memSize;
+    uint32_t codeSize;
+    uint32_t pageSize;
+    uint32_t pageCount;
+    uint32_t mips;          // Nonzero if the image is MIPS32 (see decoder.cc)
+
+    int32_t regs[32];
+    int32_t lo, hi;
+    int32_t pc;
+
+    int32_t blockAddr;
+    int32_t lastReadCount;
+};
+
+static uint64_t snapshotDataOffset(uint32_t pageCount)
+{
+    uint64_t end = sizeof(SnapshotHeader) + static_cast<uint64_t>(pageCount) * sizeof(uint32_t);
+    return (end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+static SnapshotHeader readSnapshotHeader(FILE* file, const std::string& path)
+{
+    SnapshotHeader header;
+
+    if(fread(&header, sizeof(header), 1, file) != 1 ||
+       memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0) {
+        throw std::runtime_error{path + " is not a snapshot file"};
+    }
+
+    if(header.pageSize != Memory::PAGE_SIZE) {
+        throw std::runtime_error{path + " was saved with " + std::to_string(header.pageSize) + " byte pages"};
+    }
+
+    return header;
+}
+
+// Closes the file on the way out, whichever way that is
+struct SnapshotFile
+{
+    SnapshotFile(const std::string& path, const char* mode) : file{fopen(path.c_str(), mode)}
+    {
+        if(!file) {
+            throw std::runtime_error{"Failed to open snapshot file " + path};
+        }
+    }
+
+    ~SnapshotFile() { if(file) fclose(file); }
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    FILE* file;
+};
+
+size_t VM::readSnapshotMemSize(const std::string& path)
+{
+    SnapshotFile f{path, "rb"};
+    return readSnapshotHeader(f.file, path).memSize;
+}
+
+VM::VM(const std::string& snapshotPath, FILE* in, FILE* out) :
+    mem{readSnapshotMemSize(snapshotPath)}, console{in, out}, codeSize{0}, mips{false}
+{
+    restoreSnapshot(snapshotPath);
+}
+
+void VM::saveSnapshot(const std::string& path)
+{
+    // Whatever the program printed before the checkpoint belongs to this run
+    console.flush();
+
+    auto table = mem.getPageTable();
+
+    std::vector<uint32_t> pageNumbers;
+
+    for(uint32_t i = 0; i < mem.getPageCount(); ++i) {
+        auto page = table[i];
+
+        if(page && (page[0] != 0 || memcmp(page, page + 1, Memory::PAGE_SIZE - 1) != 0)) {
+            pageNumbers.push_back(i);
+        }
+    }
+
+    SnapshotHeader header = {};
+
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+
+    header.memSize = mem.getSize();
+    header.codeSize = static_cast<uint32_t>(codeSize);
+    header.pageSize = Memory::PAGE_SIZE;
+    header.pageCount = static_cast<uint32_t>(pageNumbers.size());
+    header.mips = mips;
+
+    memcpy(header.regs, cpu.regs, sizeof(header.regs));
+    header.regs[0] = 0;
+
+    header.lo = cpu.lo;
+    header.hi = cpu.hi;
+    header.pc = cpu.pc;
+
+    header.blockAddr = console.getBlockAddr();
+    header.lastReadCount = console.getLastReadCount();
+
+    // Written to the side and renamed so a run restoring the old snapshot
+    // never sees a half written one
+    auto tempPath = path + ".tmp";
+
+    {
+        SnapshotFile f{tempPath, "wb"};
+
+        bool ok = fwrite(&header, sizeof(header), 1, f.file) == 1;
+
+        if(!pageNumbers.empty()) {
+            ok = ok && fwrite(&pageNumbers[0], sizeof(uint32_t), pageNumbers.size(), f.file) == pageNumbers.size();
+        }
+
+        std::vector<uint8_t> padding(snapshotDataOffset(header.pageCount) - sizeof(header) - pageNumbers.size() * sizeof(uint32_t));
+
+        if(!padding.empty()) {
+            ok = ok && fwrite(&padding[0], 1, padding.size(), f.file) == padding.size();
+        }
+
+        for(auto n : pageNumbers) {
+            ok = ok && fwrite(table[n], Memory::PAGE_SIZE, 1, f.file) == 1;
+        }
+
+        ok = fclose(f.file) == 0 && ok;
+        f.file = nullptr;
+
+        if(!ok) {
+            remove(tempPath.c_str());
+            throw std::runtime_error{"Failed to write snapshot file " + path};
+        }
+    }
+
+    if(rename(tempPath.c_str(), path.c_str()) != 0) {
+        // Windows won't rename over an existing file
+        remove(path.c_str());
+
+        if(rename(tempPath.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error{"Failed to write snapshot file " + path};
+        }
+    }
+}
+
+void VM::restoreSnapshot(const std::string& path)
+{
+    SnapshotFile f{path, "rb"};
+
+    auto header = readSnapshotHeader(f.file, path);
+
+    if(header.codeSize > header.memSize || header.pc < 0 || static_cast<uint32_t>(header.pc) > header.codeSize) {
+        throw std::runtime_error{path + " is corrupt"};
+    }
+
+    std::vector<uint32_t> pageNumbers(header.pageCount);
+
+    if(header.pageCount > 0 &&
+       fread(&pageNumbers[0], sizeof(uint32_t), pageNumbers.size(), f.file) != pageNumbers.size()) {
+        throw std::runtime_error{path + " is truncated"};
+    }
+
+    if(header.pageCount > 0) {
+        auto offset = snapshotDataOffset(header.pageCount);
+        size_t len = static_cast<size_t>(header.pageCount) * Memory::PAGE_SIZE;
+
+        // A mapping past the end of the file would fault when touched
+        if(fseek(f.file, 0, SEEK_END) != 0 || static_cast<uint64_t>(ftell(f.file)) < offset + len) {
+            throw std::runtime_error{path + " is truncated"};
+        }
+
+        std::shared_ptr<uint8_t> region;
+
+#ifdef WAT_SNAPSHOT_MMAP
+        // Private mapping: pages are read in as the program touches them and
+        // copied only if it writes to them, so restoring costs next to nothing
+        if(offset % static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) == 0) {
+            void* base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f.file), static_cast<off_t>(offset));
+
+            if(base != MAP_FAILED) {
+                region.reset(static_cast<uint8_t*>(base), [len](uint8_t* p) { munmap(p, len); });
+            }
+        }
+#endif
+
+        if(!region) {
+            region.reset(new uint8_t[len], std::default_delete<uint8_t[]>());
+
+            if(fseek(f.file, static_cast<long>(offset), SEEK_SET) != 0 || fread(region.get(), 1, len, f.file) != len) {
+                throw std::runtime_error{path + " is truncated"};
+            }
+        }
+
+        mem.mapPages(std::move(region), pageNumbers);
+    }
+
+    codeSize = header.codeSize;
+    mips = header.mips != 0;
+
+    cpu = {};
+
+    memcpy(cpu.regs, header.regs, sizeof(header.regs));
+
+    cpu.lo = header.lo;
+    cpu.hi = header.hi;
+    cpu.pc = header.pc;
+
+    console.restoreBlockState(header.blockAddr, header.lastReadCount);
+}
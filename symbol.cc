@@ -13,7 +13,7 @@ struct Var
     std::string name;
 
     Func* func;
-    int loc;    // Initialized to -1; could store register index or memory location as determined by compiler
+    int loc;    // Initialized to -1; the register of a local as determined by the compiler (globals are reached by label)
 
     std::unique_ptr<Typetag> typetag;
 };
@@ -26,15 +26,12 @@ struct Func
     std::vector<Var> args;
     std::vector<Var> locals;
 
-    int firstReg; // First unused register (after registers for arguments and locals have been allocated), -1 by default, assigned by compiler
-
     std::unique_ptr<Typetag> returnType;
 };
 
 struct CString
 {
     std::string str;
-    int loc;
 };
 
 struct SymbolTable
@@ -47,7 +44,7 @@ struct SymbolTable
             }
         }
 
-        funcs.emplace_back(Func{std::move(pos), std::move(name), {}, {}, -1});
+        funcs.emplace_back(Func{std::move(pos), std::move(name), {}, {}});
         return funcs.back();
     }
 
@@ -133,7 +130,7 @@ struct SymbolTable
             i += 1;
         }
 
-        strings.emplace_back(CString{std::move(str), -1});
+        strings.emplace_back(CString{std::move(str)});
         return strings.size() - 1;
     }
 
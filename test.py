@@ -1,23 +1,91 @@
+import os
 from sys import argv
-from subprocess import check_output
+from subprocess import run, PIPE
 
-def run_suite(wat_exec, suite_file):
+# Each line of the suite is a test name, optionally followed by the arguments
+# to run wat with (paths relative to here). Without arguments the name is the
+# program in tests/. Either way, tests/<name>.in (if it exists) is the input
+# and tests/<name>.out the expected output. A run that fails is expected to
+# print "error: " and the last line it wrote to stderr.
+#
+# For --jobs and --inputs runs, the files each listed run wrote (with a line
+# naming each) are what's compared, since the records printed for --inputs
+# include wall times. Those files, and anything else a test writes, go in
+# tests/tmp. Tests run in order, so one can use what an earlier one wrote (a
+# snapshot to restore, say).
+
+# The output files of the runs a --jobs or --inputs list names
+def list_outputs(args):
+    outputs = []
+
+    for flag, path in zip(args, args[1:]):
+        if flag not in ("--jobs", "--inputs"):
+            continue
+
+        for line in open(path).read().splitlines():
+            fields = line.split()
+
+            if not fields or fields[0].startswith("#"):
+                continue
+
+            if flag == "--jobs":
+                outputs.append(fields[2])
+            else:
+                outputs.append(fields[1] if len(fields) > 1 else fields[0] + ".out")
+
+    return outputs
+
+def run_suite(wat_exec, suite_file, wat_args=[]):
     test_count = 0
     failed = []
 
+    os.makedirs("tests/tmp", exist_ok=True)
+
     with open(suite_file, 'r') as f:
-        for filename in f.readlines():
-            filename = filename.rstrip()
+        for line in f.readlines():
+            args = line.split()
+
+            if not args:
+                continue
+
+            filename = args.pop(0)
 
             print("========================================")
-            
+
             input=None
-            
+
             try:
                 input = open("tests/" + filename + ".in").read().encode()
             except: pass
 
-            result = "\n".join(check_output([wat_exec, "tests/" + filename], input=input).decode().splitlines())
+            if not args:
+                mode_args = ["--mips"] if filename.endswith(".mips") else []
+                args = mode_args + ["tests/" + filename]
+
+            outputs = list_outputs(args)
+
+            for path in outputs:
+                if os.path.exists(path):
+                    os.remove(path)
+
+            proc = run([wat_exec] + wat_args + args, input=input, stdout=PIPE, stderr=PIPE)
+
+            lines = proc.stdout.decode().splitlines()
+
+            if outputs:
+                lines = []
+
+                for path in outputs:
+                    lines.append("== " + path)
+
+                    if os.path.exists(path):
+                        lines += open(path).read().splitlines()
+
+            if proc.returncode != 0:
+                errors = proc.stderr.decode().splitlines()
+                lines.append("error: " + (errors[-1] if errors else "exit code " + str(proc.returncode)))
+
+            result = "\n".join(lines)
 
             with open("tests/" + filename + ".out", 'r') as ex:
                 expected_output = ex.read().rstrip()
@@ -31,4 +99,4 @@ def run_suite(wat_exec, suite_file):
                     print(result)
 
 if __name__ == "__main__":
-    run_suite(argv[1], argv[2])
+    run_suite(argv[1], argv[2], argv[3:])
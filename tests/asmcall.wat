@@ -0,0 +1,22 @@
+#include "basic.wat"
+
+func add3(a : int, b : int, c : int) : int {
+    return a + b + c;
+}
+
+// x, y and z are in $1, $2 and $3, where add3's arguments go
+func f(x : int, y : int) : int {
+    var z : int = 100;
+
+    asm "add $3 $3 $0";
+
+    var r : int = add3(7, 8, 9);
+
+    putn(x);
+
+    return x + y + z + r;
+}
+
+func main() : void {
+    putn(f(1, 2));
+}
@@ -0,0 +1,41 @@
+#include "basic.wat"
+
+// Returns the first free address after the program image
+func heapStart() : *int {
+    var p : *int = cast(*int) 0;
+
+    asm "lis $1";
+    asm ".word memStartXXXX";
+
+    return p;
+}
+
+func main() : void {
+    var data : *int = heapStart();
+
+    // 1M words (4 MiB), well past the 64 KiB the machine used to have, in
+    // pages allocated as they're first touched
+    var count : int = 1048576;
+
+    var i : int = 0;
+    var p : *int = data;
+
+    while(i < count) {
+        *p = i - (i / 1000) * 1000;
+        p = p + 4;
+        i = i + 1;
+    }
+
+    var sum : int = 0;
+
+    i = 0;
+    p = data;
+
+    while(i < count) {
+        sum = sum + *p;
+        p = p + 4;
+        i = i + 1;
+    }
+
+    putn(sum);
+}
@@ -0,0 +1,42 @@
+#include "basic.wat"
+
+// Arguments keep the optimizer from folding these away
+func ops(a : int, b : int) : void {
+    putn(a & b);
+    putn(a | b);
+    putn(a ^ b);
+    putn(a << b);
+    putn(a >> b);
+    putn(a & 255);
+    putn(a | 4096);
+    putn(a << 3);
+    putn(a >> 1);
+
+    // Shifts bind like *, so this is (a << 2) + 1
+    putn(a << 2 + 1);
+
+    var r : int = a % 7;
+    putn(r);
+}
+
+// Powers of two become shifts, which have to round toward zero like div
+func scale(n : int) : void {
+    putn(n * 8);
+    putn(16 * n);
+    putn(n / 2);
+    putn(n / 4);
+    putn(n / 1024);
+}
+
+func main() : void {
+    ops(1000, 3);
+    ops(-1000, 5);
+
+    scale(2049);
+    scale(-2049);
+    scale(-3);
+
+    // Folded at compile time the same way
+    putn((1 << 31) >> 31);
+    putn(1000 & -8 ^ 5);
+}
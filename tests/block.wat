@@ -0,0 +1,14 @@
+#include "basic.wat"
+
+func main() : void {
+    var buf : *char = [64]"";
+
+    var n : int = read(buf, 64);
+    write(buf, n);
+    putn(n);
+
+    n = read(buf, 4);
+    write(buf, n);
+    putc(cast(char) 10);
+    putn(n);
+}
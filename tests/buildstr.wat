@@ -5,7 +5,7 @@ func main() : void {
     var i : int = 0;
 
     while(i < 8) {
-        *(x + i * 4) = cast (char) (48 + i);
+        *(x + i) = cast (char) (48 + i);
          i = i + 1;
     }
 
@@ -0,0 +1,27 @@
+#include "basic.wat"
+
+func main() : void {
+    // Four chars to a word, the first in the low byte
+    var s : *char = "abcd";
+    putn(*cast(*int) s);
+
+    // Storing a char leaves the ones beside it alone
+    var buf : *char = [8]"xxxxxxx";
+    *(buf + 2) = 'Y';
+    puts(buf);
+
+    // Chars come back sign-extended
+    *(buf + 5) = cast(char) -3;
+    putn(cast(int) *(buf + 5));
+
+    // lb and sb from asm (s, buf and p are in $1, $2 and $3)
+    var p : *char = buf;
+
+    asm "lb $4 2($3)";
+    asm "sb $4 0($3)";
+    asm "sb $0 4($3)";
+
+    puts(p);
+    write(s + 1, 2);
+    putc(cast(char) 10);
+}
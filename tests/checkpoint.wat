@@ -0,0 +1,40 @@
+#include "basic.wat"
+
+// Returns the first free address after the program image
+func heapStart() : *int {
+    var p : *int = cast(*int) 0;
+
+    asm "lis $1";
+    asm ".word memStartXXXX";
+
+    return p;
+}
+
+func main() : void {
+    var squares : *int = heapStart();
+    var i : int = 0;
+
+    while(i < 1000) {
+        *(squares + i * 4) = i * i;
+        i = i + 1;
+    }
+
+    puts("ready");
+
+    // Without --snapshot this is a no-op
+    checkpoint();
+
+    var buf : *char = [16]"";
+    var n : int = read(buf, 16);
+
+    // Digits of the line, as a number
+    var x : int = 0;
+    i = 0;
+
+    while(i < n - 1) {
+        x = x * 10 + (*(buf + i) - 48);
+        i = i + 1;
+    }
+
+    putn(*(squares + x * 4));
+}
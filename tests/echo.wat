@@ -12,7 +12,7 @@ func main() : void {
             return;
         }
 
-        *(s + len * 4) = c;
+        *(s + len) = c;
         len = len + 1;
 
         c = getc();
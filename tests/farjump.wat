@@ -0,0 +1,24 @@
+#include "basic.wat"
+
+// The array literals compile to more than 32K stores each, so the branches
+// and jumps around them are out of reach of a 16-bit offset
+func last(fill : bool, times : int) : int {
+    var big : *int = [40000]{};
+
+    if(fill) {
+        while(times > 0) {
+            big = [40000]{};
+            *(big + 39999 * 4) = *(big + 39999 * 4) + times;
+            times = times - 1;
+        }
+    } else {
+        return 2;
+    }
+
+    return *(big + 39999 * 4);
+}
+
+func main() : void {
+    putn(last(true, 3));
+    putn(last(false, 3));
+}
@@ -0,0 +1,33 @@
+#include "basic.wat"
+
+func main() : void {
+    var size : int = 4;
+
+    // Folds once size is known, which makes scale known too
+    var scale : int = size * 3 + 1;
+
+    // Wraps around like the machine does
+    var big : int = 2147483647 + 2;
+
+    if(scale > 20) {
+        puts("unreachable");
+    } else {
+        putn(scale);
+    }
+
+    while(size < 0) {
+        puts("never");
+    }
+
+    putn(big);
+    putn(-(7 / 2) + 9 - 4 * 2);
+    putn(cast(int) (scale == 13 && size != 3));
+
+    var i : int = 0;
+
+    while(i < size) {
+        i = i + 1;
+    }
+
+    putn(i);
+}
@@ -0,0 +1,25 @@
+#include "basic.wat"
+
+// Every call gets its own copy of the array, so recursion can't stomp on it
+func countdown(depth : int) : int {
+    var buf : *int = [2]{};
+
+    *buf = depth;
+
+    if(depth > 0) {
+        countdown(depth - 1);
+    }
+
+    return *buf;
+}
+
+// The arguments past the eighth are passed on the stack
+func weigh(a : int, b : int, c : int, d : int, e : int, f : int, g : int, h : int, i : int, j : int) : int {
+    return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7 + h * 8 + i * 9 + j * 10;
+}
+
+func main() : void {
+    putn(countdown(5));
+    putn(weigh(1, 2, 3, 4, 5, 6, 7, 8, 9, 10));
+    putn(weigh(1, 2, 3, 4, 5, 6, 7, 8, 9, weigh(1, 1, 1, 1, 1, 1, 1, 1, 1, 1)));
+}
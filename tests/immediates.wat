@@ -0,0 +1,68 @@
+#include "basic.wat"
+
+// Arguments and locals are $1, $2, ... in functions with asm
+func build(x : int) : int {
+    var r : int = 0;
+
+    asm "lui $2, 0x1234";
+    asm "ori $2, $2, 0x5678";
+    asm "addi $2, $2, -8";
+    asm "slti $3, $1, 100";
+    asm "add $2, $2, $3";
+
+    return r;
+}
+
+func sign(x : int) : int {
+    var r : int = 0;
+
+    asm "bltz $1, signneg";
+    asm "blez $1, signend";
+    asm "addi $2, $0, 1";
+    asm "beq $0, $0, signend";
+    asm "signneg:";
+    asm "addi $2, $0, -1";
+    asm "signend:";
+
+    return r;
+}
+
+// Every comparison against a constant, both as a condition and as a value
+func classify(x : int) : int {
+    var bits : int = 0;
+
+    if(x < 0) bits = bits + 1;
+    if(x > 0) bits = bits + 2;
+    if(x <= 0) bits = bits + 4;
+    if(x >= 0) bits = bits + 8;
+    if(x < 5) bits = bits + 16;
+    if(x > 5) bits = bits + 32;
+    if(x <= 5) bits = bits + 64;
+    if(x >= 5) bits = bits + 128;
+
+    var le : bool = (x <= 5);
+    var ge : bool = (x >= 5);
+    var gt : bool = (x > 5);
+
+    if(le) bits = bits + 256;
+    if(ge) bits = bits + 512;
+    if(gt) bits = bits + 1024;
+
+    return bits;
+}
+
+func main() : void {
+    putn(build(3));
+    putn(build(300));
+    putn(sign(-7) * 100 + sign(0) * 10 + sign(7));
+    putn(classify(-2));
+    putn(classify(0));
+    putn(classify(5));
+    putn(classify(9));
+
+    // Constants which take addi, ori, lui and lis to load
+    putn(-300);
+    putn(40000);
+    putn(196608);
+    putn(-40000);
+}
@@ -0,0 +1,44 @@
+#include "basic.wat"
+
+// Small leaves like these are copied into their callers
+
+// The label gets renamed in each copy, and the copy can't touch the
+// caller's version of x
+func clampNeg(x : int) : int {
+    asm "bgez $1 clampDone";
+    asm "add $1 $0 $0";
+    asm "clampDone:";
+    return x;
+}
+
+func max(a : int, b : int) : int {
+    if(a < b) return b;
+    return a;
+}
+
+// Only a leaf once max is inlined into it
+func twice(a : int) : int {
+    return max(a, a) + a;
+}
+
+func fact(n : int) : int {
+    if(n < 2) return 1;
+    return n * fact(n - 1);
+}
+
+func main() : void {
+    var x : int = 0 - 4;
+    var sum : int = 0;
+    var i : int = 0;
+
+    while(i < 5) {
+        sum = sum + clampNeg(i - 2) + max(i, 3);
+        i = i + 1;
+    }
+
+    putn(sum);
+    putn(clampNeg(x));
+    putn(x);
+    putn(twice(4));
+    putn(fact(5));
+}
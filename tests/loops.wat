@@ -0,0 +1,98 @@
+#include "basic.wat"
+
+func main() : void {
+    // Runs a known number of times, so it's unrolled
+    var sum : int = 0;
+    var i : int = 0;
+
+    while(i < 4) {
+        sum = sum + i * 10;
+        i = i + 1;
+    }
+
+    putn(sum);
+    putn(i);
+
+    // Counting down, and never running at all
+    i = 9;
+
+    while(i > 0) {
+        sum = sum + i;
+        i = i - 3;
+    }
+
+    while(i != 0) {
+        sum = 0;
+        i = i + 1;
+    }
+
+    putn(sum);
+
+    // Too many trips to unroll. The constants and the scale of arr are the
+    // same every time around, so they're worked out before the loop.
+    var arr : *int = []{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    var base : int = 100000;
+
+    i = 0;
+    sum = 0;
+
+    while(i < 12) {
+        var scale : int = base * 3;
+
+        sum = sum + *(arr + i * 4) * scale + 70000;
+        i = i + 1;
+    }
+
+    putn(sum);
+
+    // The inner loop's invariants move out of both loops
+    var j : int = 0;
+    var count : int = 0;
+
+    i = 0;
+
+    while(i < 10) {
+        j = 0;
+
+        while(j < i) {
+            count = count + 100000 + base;
+            j = j + 1;
+        }
+
+        i = i + 1;
+    }
+
+    putn(count);
+
+    // prev is read before it's set in each trip, so it has to stay put
+    var prev : int = 0;
+
+    i = 0;
+
+    while(i < 10) {
+        sum = prev;
+        prev = 40000 + i;
+        i = i + 1;
+    }
+
+    putn(sum);
+
+    // The limit wraps to a negative number, so this never runs
+    i = 2147483645;
+
+    while(i < 2147483650) {
+        putn(i);
+        i = i + 1;
+    }
+
+    // The count wraps on the way to the limit, after three trips
+    count = 0;
+    i = 2147483646;
+
+    while(i != -2147483647) {
+        count = count + 1;
+        i = i + 1;
+    }
+
+    putn(count);
+}
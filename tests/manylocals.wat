@@ -0,0 +1,55 @@
+#include "basic.wat"
+
+// More locals live at once than there are registers, kept across calls
+func sum(n : int) : int {
+    var a0 : int = n + 0;
+    var a1 : int = n + 1;
+    var a2 : int = n + 2;
+    var a3 : int = n + 3;
+    var a4 : int = n + 4;
+    var a5 : int = n + 5;
+    var a6 : int = n + 6;
+    var a7 : int = n + 7;
+    var a8 : int = n + 8;
+    var a9 : int = n + 9;
+    var a10 : int = n + 10;
+    var a11 : int = n + 11;
+    var a12 : int = n + 12;
+    var a13 : int = n + 13;
+    var a14 : int = n + 14;
+    var a15 : int = n + 15;
+    var a16 : int = n + 16;
+    var a17 : int = n + 17;
+    var a18 : int = n + 18;
+    var a19 : int = n + 19;
+    var a20 : int = n + 20;
+    var a21 : int = n + 21;
+    var a22 : int = n + 22;
+    var a23 : int = n + 23;
+    var a24 : int = n + 24;
+    var a25 : int = n + 25;
+    var a26 : int = n + 26;
+    var a27 : int = n + 27;
+    var a28 : int = n + 28;
+    var a29 : int = n + 29;
+    var total : int = 0;
+
+    if(n > 0) {
+        total = sum(n - 1);
+    }
+
+    total = total + a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9
+        + a10 + a11 + a12 + a13 + a14 + a15 + a16 + a17 + a18 + a19
+        + a20 + a21 + a22 + a23 + a24 + a25 + a26 + a27 + a28 + a29;
+
+    return total;
+}
+
+func mix(a : int, b : int, c : int, d : int, e : int, f : int, g : int, h : int) : int {
+    return a * b + c * d + e * f + g * h;
+}
+
+func main() : void {
+    putn(sum(3));
+    putn(mix(1, 2, 3, 4, 5, 6, 7, mix(8, 7, 6, 5, 4, 3, 2, 1)));
+}
@@ -0,0 +1,14 @@
+#include "basic.wat"
+
+// Run with --mem 64K, so the store past the end fails
+func main() : void {
+    var p : *int = cast(*int) 40000;
+
+    *p = 5;
+    putn(*p);
+
+    p = cast(*int) 65536;
+    *p = 6;
+
+    putn(*p);
+}
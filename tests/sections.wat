@@ -0,0 +1,35 @@
+#include "basic.wat"
+
+// Globals come after the code and the strings, which the array literal
+// below pushes well past the 32K a lw or sw can reach from $0
+var total : int;
+var calls : int;
+
+func fill() : int {
+    var big : *int = [10000]{};
+
+    *(big + 9999 * 4) = 7;
+
+    return *(big + 9999 * 4);
+}
+
+func add(n : int) : void {
+    total = total + n;
+    calls = calls + 1;
+}
+
+func main() : void {
+    // The same literal is only stored once
+    var a : *char = "same";
+    var b : *char = "same";
+
+    if(a == b) {
+        puts(a);
+    }
+
+    add(fill());
+    add(35);
+
+    putn(total);
+    putn(calls);
+}
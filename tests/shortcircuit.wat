@@ -0,0 +1,37 @@
+#include "basic.wat"
+
+var calls : int;
+
+func check(result : bool) : bool {
+    calls = calls + 1;
+    return result;
+}
+
+func main() : void {
+    calls = 0;
+
+    // The right side only runs when the left doesn't decide it
+    if(check(false) && check(true)) {
+        puts("wrong");
+    }
+
+    if(check(true) || check(false)) {
+        putn(calls);
+    }
+
+    var both : bool = (check(true) && check(false));
+
+    if(both) {
+        puts("wrong");
+    }
+
+    putn(calls);
+
+    var i : int = 0;
+
+    while(i < 10 && (i <= 2 || i != 5)) {
+        i = i + 1;
+    }
+
+    putn(i);
+}
@@ -0,0 +1,26 @@
+#include "basic.wat"
+
+// Run with --mem 1G. Only the pages it touches are allocated, so a few words
+// spread across the whole space cost next to nothing.
+func main() : void {
+    var step : int = 134217728;
+    var p : int = step;
+    var i : int = 1;
+
+    while(i < 8) {
+        *cast(*int) p = i;
+        p = p + step;
+        i = i + 1;
+    }
+
+    var sum : int = 0;
+
+    p = step;
+
+    while(p < 1073741824 && p > 0) {
+        sum = sum + *cast(*int) p;
+        p = p + step;
+    }
+
+    putn(sum);
+}
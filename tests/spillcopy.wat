@@ -0,0 +1,49 @@
+#include "basic.wat"
+
+var g : int;
+
+// More locals than registers, so some copies are between two stack slots
+func main() : void {
+    g = 1;
+
+    var a0 : int = g + 0;
+    var a1 : int = g + 1;
+    var a2 : int = g + 2;
+    var a3 : int = g + 3;
+    var a4 : int = g + 4;
+    var a5 : int = g + 5;
+    var a6 : int = g + 6;
+    var a7 : int = g + 7;
+    var a8 : int = g + 8;
+    var a9 : int = g + 9;
+    var a10 : int = g + 10;
+    var a11 : int = g + 11;
+    var a12 : int = g + 12;
+    var a13 : int = g + 13;
+    var a14 : int = g + 14;
+    var a15 : int = g + 15;
+    var a16 : int = g + 16;
+    var a17 : int = g + 17;
+    var a18 : int = g + 18;
+    var a19 : int = g + 19;
+    var a20 : int = g + 20;
+    var a21 : int = g + 21;
+    var a22 : int = g + 22;
+    var a23 : int = g + 23;
+    var a24 : int = g + 24;
+    var a25 : int = g + 25;
+    var a26 : int = g + 26;
+    var a27 : int = g + 27;
+    var a28 : int = g + 28;
+    var a29 : int = g + 29;
+    var a30 : int = g + 30;
+    var a31 : int = g + 31;
+    var a32 : int = g + 32;
+    var a33 : int = g + 33;
+
+    a0 = a1;
+    a1 = a1 + g;
+
+    putn(a0);
+    putn(a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9 + a10 + a11 + a12 + a13 + a14 + a15 + a16 + a17 + a18 + a19 + a20 + a21 + a22 + a23 + a24 + a25 + a26 + a27 + a28 + a29 + a30 + a31 + a32 + a33);
+}
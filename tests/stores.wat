@@ -0,0 +1,19 @@
+#include "basic.wat"
+
+// Filling in the literal is a long run of stores, more than fit in one
+// translated block
+func main() : void {
+    var a : *int = [250]{3};
+
+    *(a + 249 * 4) = 4;
+
+    var sum : int = 0;
+    var i : int = 0;
+
+    while(i < 250) {
+        sum = sum + *(a + i * 4);
+        i = i + 1;
+    }
+
+    putn(sum);
+}
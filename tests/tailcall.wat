@@ -0,0 +1,42 @@
+#include "basic.wat"
+
+// Each of these recurses far deeper than the stack could hold a frame
+// for, so they only work because their tail calls are jumps
+
+func sumTo(n : int, acc : int) : int {
+    if(n == 0) return acc;
+    return sumTo(n - 1, acc + (n & 1));
+}
+
+func isEven(n : int) : bool {
+    if(n == 0) return true;
+    return isOdd(n - 1);
+}
+
+func isOdd(n : int) : bool {
+    if(n == 0) return false;
+    return isEven(n - 1);
+}
+
+var count : int;
+
+func countDown(n : int) : void {
+    if(n > 0) {
+        count = count + 1;
+        countDown(n - 1);
+    }
+}
+
+func main() : void {
+    putn(sumTo(5000000, 0));
+
+    if(isEven(5000001)) {
+        puts("wrong");
+    } else {
+        puts("odd");
+    }
+
+    count = 0;
+    countDown(5000000);
+    putn(count);
+}
@@ -5,7 +5,7 @@ func putc(c : char) : void {
 func puts(s : *char) : void {
     while (*s != cast(char) 0) {
         putc(*s);
-        s = s + 4;
+        s = s + 1;
     }
 }
 
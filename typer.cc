@@ -163,6 +163,18 @@ struct Typer
         }
     }
 
+    // The type of an expression inside func (nullptr at the top level)
+    std::unique_ptr<Typetag> getType(SymbolTable& table, const AST& ast, Func* func)
+    {
+        curFunc = func;
+
+        auto type = inferType(table, ast);
+
+        curFunc = nullptr;
+
+        return type;
+    }
+
 private:
     Func* curFunc = nullptr;
 
@@ -214,7 +226,8 @@ private:
                 auto rhsType = inferType(table, bst.getRhs());
 
                 switch(bst.getOp()) {
-                    case '+': case '-': case '*': case '/': {
+                    case '+': case '-': case '*': case '/': case '%':
+                    case '&': case '|': case '^': case TOK_SHL: case TOK_SHR: {
                         if(lhsType->tag == Typetag::PTR) {
                             if(rhsType->tag != Typetag::INT && rhsType->tag != Typetag::PTR) {
                         throw PosError{ast.getPos(), "Attempted to perform binary operation on pointer with a " + static_cast<std::string>(*rhsType)};